@@ -0,0 +1,499 @@
+#ifndef POOL_FUTURE_H
+#define POOL_FUTURE_H
+
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <exception>
+#include <future>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+namespace std
+{
+// 每次向系统申请的块数
+#define  POOL_SLAB_BLOCKS 64
+// 每个线程缓存的最大空闲块数, 超出的一半归还到全局
+#define  POOL_SLAB_CACHE 1024
+
+//定长内存块分配器, 每个线程一个空闲链表, 空闲块过多或线程退出时归还到全局链表
+//块不会还给系统, 适合数量稳定、频繁创建销毁的小对象
+template<size_t Size>
+class pool_slab{
+	static_assert(Size >= sizeof(void*) && Size % 16 == 0, "pool_slab block size");
+
+	struct node { node* next; };
+
+	struct cache {
+		node* head = nullptr;
+		size_t count = 0;
+		~cache() { give_back(*this, count); }
+	};
+
+public:
+	static void* allocate() {
+		cache& c = local();
+		if (!c.head)
+			refill(c);
+		node* n = c.head;
+		c.head = n->next;
+		--c.count;
+		return n;
+	}
+
+	static void deallocate(void* p) {
+		cache& c = local();
+		node* n = static_cast<node*>(p);
+		n->next = c.head;
+		c.head = n;
+		if (++c.count > POOL_SLAB_CACHE)
+			give_back(c, c.count / 2);
+	}
+
+private:
+	static cache& local() {
+		static thread_local cache c;
+		return c;
+	}
+
+	static mutex& depot_lock() {
+		static mutex lock;
+		return lock;
+	}
+
+	static node*& depot() {
+		static node* head = nullptr;
+		return head;
+	}
+
+	static void refill(cache& c) {
+		{
+			lock_guard<mutex> lock{ depot_lock() };
+			for (size_t i = 0; i < POOL_SLAB_BLOCKS && depot(); ++i) {
+				node* n = depot();
+				depot() = n->next;
+				n->next = c.head;
+				c.head = n;
+				++c.count;
+			}
+		}
+		if (c.head)
+			return;
+
+		char* chunk = static_cast<char*>(::operator new(Size * POOL_SLAB_BLOCKS));
+		for (size_t i = 0; i < POOL_SLAB_BLOCKS; ++i) {
+			node* n = reinterpret_cast<node*>(chunk + i * Size);
+			n->next = c.head;
+			c.head = n;
+		}
+		c.count += POOL_SLAB_BLOCKS;
+	}
+
+	static void give_back(cache& c, size_t count) {
+		if (count == 0)
+			return;
+		lock_guard<mutex> lock{ depot_lock() };
+		for (; count > 0 && c.head; --count) {
+			node* n = c.head;
+			c.head = n->next;
+			--c.count;
+			n->next = depot();
+			depot() = n;
+		}
+	}
+};
+
+//共享状态的公共部分: 一个原子标志表示完成, 只有真正需要等待时才进入 futex
+class pool_state_base{
+public:
+	pool_state_base() : _flag(PENDING), _refs(2), _failed(false) {}
+
+	bool ready() const { return _flag.load(memory_order_acquire) == READY; }
+
+	void wait() {
+		for (int spin = 0; spin < 64; ++spin) {
+			if (ready())
+				return;
+		}
+		while (!ready()) {
+			int expected = PENDING;
+			if (_flag.compare_exchange_strong(expected, WAITING) || expected == WAITING)
+				futex(FUTEX_WAIT_PRIVATE, WAITING, nullptr);
+		}
+	}
+
+	// 超时返回 false
+	bool wait_for(chrono::nanoseconds timeout) {
+		auto deadline = chrono::steady_clock::now() + timeout;
+		while (!ready()) {
+			auto left = chrono::duration_cast<chrono::nanoseconds>(deadline - chrono::steady_clock::now());
+			if (left.count() <= 0)
+				return false;
+			struct timespec ts;
+			ts.tv_sec = left.count() / 1000000000;
+			ts.tv_nsec = left.count() % 1000000000;
+			int expected = PENDING;
+			if (_flag.compare_exchange_strong(expected, WAITING) || expected == WAITING)
+				futex(FUTEX_WAIT_PRIVATE, WAITING, &ts);
+		}
+		return true;
+	}
+
+	bool failed() const { return _failed; }
+
+	const exception_ptr& error() const { return _error; }
+
+	void set_exception(exception_ptr error) {
+		_error = error;
+		_failed = true;
+		publish();
+	}
+
+protected:
+	enum { PENDING = 0, WAITING = 1, READY = 2 };
+
+	void publish() {
+		if (_flag.exchange(READY, memory_order_acq_rel) == WAITING)
+			futex(FUTEX_WAKE_PRIVATE, INT_MAX, nullptr);
+	}
+
+	// 返回是否是最后一个引用
+	bool unref() { return _refs.fetch_sub(1, memory_order_acq_rel) == 1; }
+
+private:
+	void futex(int op, int value, const struct timespec* timeout) {
+		syscall(SYS_futex, reinterpret_cast<int*>(&_flag), op, value, timeout, nullptr, 0);
+	}
+
+	atomic<int> _flag;
+	atomic<int> _refs;	//promise 与 future 各一个
+	bool _failed;
+	exception_ptr _error;
+};
+
+#define POOL_SLAB_SIZE(n) ((((n) + 63) / 64) * 64)
+
+//返回值直接存放在共享状态内
+template<class T>
+class pool_state : public pool_state_base{
+	static_assert(alignof(T) <= 16, "pool_state value alignment");
+
+public:
+	static pool_state* create() {
+		typedef pool_slab<POOL_SLAB_SIZE(sizeof(pool_state))> slab;
+		return new (slab::allocate()) pool_state();
+	}
+
+	void release() {
+		typedef pool_slab<POOL_SLAB_SIZE(sizeof(pool_state))> slab;
+		if (unref()) {
+			this->~pool_state();
+			slab::deallocate(this);
+		}
+	}
+
+	template<class U>
+	void set_value(U&& value) {
+		new (&_value) T(forward<U>(value));
+		_hasValue = true;
+		publish();
+	}
+
+	T& value() { return *reinterpret_cast<T*>(&_value); }
+
+private:
+	pool_state() : _hasValue(false) {}
+	~pool_state() {
+		if (_hasValue)
+			value().~T();
+	}
+
+	typename aligned_storage<sizeof(T), alignof(T)>::type _value;
+	bool _hasValue;
+};
+
+template<>
+class pool_state<void> : public pool_state_base{
+public:
+	static pool_state* create() {
+		typedef pool_slab<POOL_SLAB_SIZE(sizeof(pool_state))> slab;
+		return new (slab::allocate()) pool_state();
+	}
+
+	void release() {
+		typedef pool_slab<POOL_SLAB_SIZE(sizeof(pool_state))> slab;
+		if (unref()) {
+			this->~pool_state();
+			slab::deallocate(this);
+		}
+	}
+
+	void set_value() { publish(); }
+
+private:
+	pool_state() {}
+	~pool_state() {}
+};
+
+template<class T> class pool_promise;
+
+//轻量 future, 只能移动, get()/try_get() 之后失效
+//  get()     : 等待结果, 任务抛出的异常在此重新抛出
+//  try_get() : 不抛异常的取值方式, 任务失败时返回 false, 异常可由 error() 取得
+template<class T>
+class pool_future{
+	friend class pool_promise<T>;
+public:
+	pool_future() : _state(nullptr) {}
+	pool_future(pool_future&& other) : _state(other._state) { other._state = nullptr; }
+	pool_future& operator=(pool_future&& other) {
+		if (this != &other) {
+			reset();
+			_state = other._state;
+			other._state = nullptr;
+		}
+		return *this;
+	}
+	pool_future(const pool_future&) = delete;
+	pool_future& operator=(const pool_future&) = delete;
+	~pool_future() { reset(); }
+
+	bool valid() const { return _state != nullptr; }
+	bool ready() const { return _state && _state->ready(); }
+	void wait() const { _state->wait(); }
+
+	template<class Rep, class Period>
+	bool wait_for(const chrono::duration<Rep, Period>& timeout) const {
+		return _state->wait_for(chrono::duration_cast<chrono::nanoseconds>(timeout));
+	}
+
+	T get() {
+		_state->wait();
+		if (_state->failed()) {
+			exception_ptr error = _state->error();
+			reset();
+			rethrow_exception(error);
+		}
+		T value(move(_state->value()));
+		reset();
+		return value;
+	}
+
+	bool try_get(T& out) {
+		_state->wait();
+		if (_state->failed())
+			return false;
+		out = move(_state->value());
+		reset();
+		return true;
+	}
+
+	// 任务失败时的异常, 仅在 try_get() 返回 false 后有效
+	exception_ptr error() const { return _state ? _state->error() : exception_ptr(); }
+
+private:
+	explicit pool_future(pool_state<T>* state) : _state(state) {}
+
+	void reset() {
+		if (_state) {
+			_state->release();
+			_state = nullptr;
+		}
+	}
+
+	pool_state<T>* _state;
+};
+
+template<>
+class pool_future<void>{
+	friend class pool_promise<void>;
+public:
+	pool_future() : _state(nullptr) {}
+	pool_future(pool_future&& other) : _state(other._state) { other._state = nullptr; }
+	pool_future& operator=(pool_future&& other) {
+		if (this != &other) {
+			reset();
+			_state = other._state;
+			other._state = nullptr;
+		}
+		return *this;
+	}
+	pool_future(const pool_future&) = delete;
+	pool_future& operator=(const pool_future&) = delete;
+	~pool_future() { reset(); }
+
+	bool valid() const { return _state != nullptr; }
+	bool ready() const { return _state && _state->ready(); }
+	void wait() const { _state->wait(); }
+
+	template<class Rep, class Period>
+	bool wait_for(const chrono::duration<Rep, Period>& timeout) const {
+		return _state->wait_for(chrono::duration_cast<chrono::nanoseconds>(timeout));
+	}
+
+	void get() {
+		_state->wait();
+		if (_state->failed()) {
+			exception_ptr error = _state->error();
+			reset();
+			rethrow_exception(error);
+		}
+		reset();
+	}
+
+	bool try_get() {
+		_state->wait();
+		if (_state->failed())
+			return false;
+		reset();
+		return true;
+	}
+
+	exception_ptr error() const { return _state ? _state->error() : exception_ptr(); }
+
+private:
+	explicit pool_future(pool_state<void>* state) : _state(state) {}
+
+	void reset() {
+		if (_state) {
+			_state->release();
+			_state = nullptr;
+		}
+	}
+
+	pool_state<void>* _state;
+};
+
+//轻量 promise, 只能移动; 未设置结果就销毁时 future 得到 broken_promise
+template<class T>
+class pool_promise{
+public:
+	pool_promise() : _state(pool_state<T>::create()), _retrieved(false) {}
+	pool_promise(pool_promise&& other) : _state(other._state), _retrieved(other._retrieved) { other._state = nullptr; }
+	pool_promise(const pool_promise&) = delete;
+	pool_promise& operator=(const pool_promise&) = delete;
+	~pool_promise() {
+		if (_state) {
+			if (!_state->ready())
+				_state->set_exception(make_exception_ptr(future_error(future_errc::broken_promise)));
+			release();
+		}
+	}
+
+	bool valid() const { return _state != nullptr; }
+
+	pool_future<T> get_future() {
+		if (!_state || _retrieved)
+			throw future_error(future_errc::future_already_retrieved);
+		_retrieved = true;
+		return pool_future<T>(_state);
+	}
+
+	template<class U>
+	void set_value(U&& value) { _state->set_value(forward<U>(value)); }
+
+	void set_exception(exception_ptr error) { _state->set_exception(error); }
+
+	// 执行 fn 并把返回值或异常写入共享状态
+	template<class F>
+	void run(F& fn) {
+		try {
+			_state->set_value(fn());
+		} catch (...) {
+			_state->set_exception(current_exception());
+		}
+	}
+
+private:
+	void release() {
+		// 没有取走 future 时替它释放引用
+		if (!_retrieved)
+			_state->release();
+		_state->release();
+		_state = nullptr;
+	}
+
+	pool_state<T>* _state;
+	bool _retrieved;
+};
+
+template<>
+class pool_promise<void>{
+public:
+	pool_promise() : _state(pool_state<void>::create()), _retrieved(false) {}
+	pool_promise(pool_promise&& other) : _state(other._state), _retrieved(other._retrieved) { other._state = nullptr; }
+	pool_promise(const pool_promise&) = delete;
+	pool_promise& operator=(const pool_promise&) = delete;
+	~pool_promise() {
+		if (_state) {
+			if (!_state->ready())
+				_state->set_exception(make_exception_ptr(future_error(future_errc::broken_promise)));
+			release();
+		}
+	}
+
+	bool valid() const { return _state != nullptr; }
+
+	pool_future<void> get_future() {
+		if (!_state || _retrieved)
+			throw future_error(future_errc::future_already_retrieved);
+		_retrieved = true;
+		return pool_future<void>(_state);
+	}
+
+	void set_value() { _state->set_value(); }
+
+	void set_exception(exception_ptr error) { _state->set_exception(error); }
+
+	template<class F>
+	void run(F& fn) {
+		try {
+			fn();
+			_state->set_value();
+		} catch (...) {
+			_state->set_exception(current_exception());
+		}
+	}
+
+private:
+	void release() {
+		if (!_retrieved)
+			_state->release();
+		_state->release();
+		_state = nullptr;
+	}
+
+	pool_state<void>* _state;
+	bool _retrieved;
+};
+
+//放进 std::function 的任务, 拥有 promise: 执行时写入结果, 没有执行就被丢弃(如线程池
+//析构时还在队列中)则 future 得到 broken_promise. std::function 要求可复制, 而任务队列
+//只移动它, 所以复制时像 auto_ptr 一样转移 promise
+template<class T, class F>
+class pool_task{
+public:
+	pool_task(pool_promise<T>&& promise, F&& fn) : _promise(move(promise)), _fn(move(fn)) {}
+	pool_task(pool_task&& other) : _promise(move(other._promise)), _fn(move(other._fn)) {}
+	pool_task(const pool_task& other) : _promise(move(other._promise)), _fn(other._fn) {}
+	pool_task& operator=(const pool_task&) = delete;
+
+	void operator()() {
+		pool_promise<T> promise(move(_promise)); // 只执行一次
+		if (promise.valid())
+			promise.run(_fn);
+	}
+
+private:
+	mutable pool_promise<T> _promise;
+	F _fn;
+};
+
+}
+#endif
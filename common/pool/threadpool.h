@@ -9,6 +9,9 @@
 #include <thread>
 #include <functional>
 #include <stdexcept>
+#include <chrono>
+#include "../system/TimerHeap.h"
+#include "pool_future.h"
 
 namespace std
 {
@@ -28,13 +31,23 @@ private:
 	condition_variable _task_cv;   	//条件阻塞
 	atomic<bool> _run{ true };     	//线程池是否执行
 	atomic<int>  _idlThrNum{ 0 };  	//空闲线程数量
+	TimerHeap<Task> _timers;        	//定时任务, 受 _lock 保护
+	bool _timerWaiter{ false };     	//是否已有空闲线程在等待最近的定时任务
+	condition_variable _park_cv;   	//补偿线程休眠
+	int _parkNum{ 0 };              	//阻塞结束后待休眠的线程数, 受 _lock 保护
+	int _parkedNum{ 0 };            	//休眠中的线程数, 受 _lock 保护
+	int _unparkNum{ 0 };            	//待唤醒的休眠线程数, 受 _lock 保护
 
 public:
 	inline threadpool(unsigned short size = 4) { addThread(size); }
 
 	inline ~threadpool(){
-		_run=false;
+		{
+			lock_guard<mutex> lock{ _lock };
+			_run=false;
+		}
 		_task_cv.notify_all(); // 唤醒所有线程执行
+		_park_cv.notify_all();
 
 		for (thread& thread : _pool) {
 			//thread.detach(); // 让线程“自生自灭”
@@ -68,47 +81,237 @@ public:
 			_tasks.emplace([task](){ // push(Task{...}) 放到队列后面
 				(*task)();
 			});
+#ifdef THREADPOOL_AUTO_GROW
+			if (_idlThrNum < 1)
+				growLocked(1);
+#endif // !THREADPOOL_AUTO_GROW
 		}
 
+		_task_cv.notify_one();
+
+		return future;
+	}
+
+	// 与 commit 相同, 但返回 pool_future: 共享状态取自线程本地的 slab, 不经过
+	// packaged_task/make_shared 的堆分配, 完成只是一个原子标志, get() 只在结果
+	// 未就绪时才进入 futex 等待. 绑定后的函数对象需要可复制.
+	// 不想处理异常时用 .try_get(value), 任务抛异常返回 false
+	template<class F, class... Args>
+	auto commit_fast(F&& f, Args&&... args) ->pool_future<decltype(f(args...))>{
+
+		if (!_run)    // stoped
+			throw runtime_error("commit on ThreadPool is stopped.");
+
+		using RetType = decltype(f(args...));
+
+		pool_promise<RetType> promise;
+		pool_future<RetType> future = promise.get_future();
+		auto fn = bind(forward<F>(f), forward<Args>(args)...);
+		// 任务拥有 promise, 抛异常或线程池析构时被丢弃也会让 future 得到 broken_promise
+		Task task(pool_task<RetType, decltype(fn)>(move(promise), move(fn)));
+		{
+			lock_guard<mutex> lock{ _lock };
 #ifdef THREADPOOL_AUTO_GROW
-		if (_idlThrNum < 1 && _pool.size() < THREADPOOL_MAX_NUM)
-			addThread(1);
+			if (_idlThrNum < 1)
+				growLocked(1);
 #endif // !THREADPOOL_AUTO_GROW
+			_tasks.push(move(task)); // 最后入队, 之前抛出的异常不会留下已入队的任务
+		}
 
 		_task_cv.notify_one();
 
 		return future;
 	}
 
+	// 延时执行, 到期后直接放入任务队列, 不经过 TimerManager 的 libevent 线程
+	// 返回的 TimerHandle 可用于取消
+	template<class Rep, class Period, class F>
+	TimerHandle schedule_after(const chrono::duration<Rep, Period>& delay, F&& f) {
+		return schedule(chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration>(delay),
+						forward<F>(f), chrono::steady_clock::duration::zero());
+	}
+
+	// 在指定时间点执行, 非 steady_clock 的时间点按当前差值换算
+	template<class Clock, class Duration, class F>
+	TimerHandle schedule_at(const chrono::time_point<Clock, Duration>& tp, F&& f) {
+		return schedule_after(tp - Clock::now(), forward<F>(f));
+	}
+
+	// 按固定频率周期执行, 第一次在一个周期之后
+	template<class Rep, class Period, class F>
+	TimerHandle schedule_every(const chrono::duration<Rep, Period>& period, F&& f) {
+		auto step = chrono::duration_cast<chrono::steady_clock::duration>(period);
+		if (step <= chrono::steady_clock::duration::zero())
+			throw invalid_argument("schedule_every needs a positive period.");
+		return schedule(chrono::steady_clock::now() + step, forward<F>(f), step);
+	}
+
+	// 阻塞标记, 在工作线程中包住阻塞的文件/网络 IO:
+	// {
+	//     std::threadpool::blocking_scope blocking;
+	//     fread(...);
+	// }
+	// 进入时唤醒或新建一个补偿线程, 退出后多出的线程在下一个任务前休眠,
+	// 使阻塞期间仍有与原来相同数量的线程在执行计算任务.
+	// 不在线程池工作线程中使用时什么也不做, 嵌套使用只有最外层生效.
+	class blocking_scope {
+	public:
+		blocking_scope() : _owner(threadpool::current()), _compensated(false) {
+			if (_owner && depth()++ == 0)
+				_compensated = _owner->beginBlocking();
+		}
+		~blocking_scope() {
+			if (_owner)
+				--depth();
+			if (_compensated)
+				_owner->endBlocking();
+		}
+		blocking_scope(const blocking_scope&) = delete;
+		blocking_scope& operator=(const blocking_scope&) = delete;
+
+	private:
+		static int& depth() {
+			static thread_local int value = 0;
+			return value;
+		}
+		threadpool* _owner;
+		bool _compensated;
+	};
+
 	//空闲线程数量
 	int idlCount() { return _idlThrNum; }
 	//线程数量
-	int thrCount() { return _pool.size(); }
+	int thrCount() {
+		lock_guard<mutex> lock{ _lock };
+		return _pool.size();
+	}
 	
+private:
+	template<class F>
+	TimerHandle schedule(chrono::steady_clock::time_point when, F&& f, chrono::steady_clock::duration period) {
+		if (!_run)    // stoped
+			throw runtime_error("schedule on ThreadPool is stopped.");
+
+		Task fn(forward<F>(f));
+		TimerHandle handle;
+		bool earliest;
+		{
+			lock_guard<mutex> lock{ _lock };
+			earliest = _timers.empty() || when < _timers.next();
+			handle = _timers.push(when, [fn](){
+				try { fn(); } catch (...) {} // 与 commit 一致, 异常不影响工作线程
+			}, period);
+		}
+		// 最近的到期时间变了, 让等待定时的线程重新计算
+		if (earliest)
+			_task_cv.notify_all();
+		return handle;
+	}
+
+	// 当前线程所属的线程池, 非工作线程为 nullptr
+	static threadpool*& current() {
+		static thread_local threadpool* pool = nullptr;
+		return pool;
+	}
+
+	// 返回是否有补偿线程, 没有时(已停止或到达 THREADPOOL_MAX_NUM)退出阻塞也不休眠线程
+	bool beginBlocking() {
+		lock_guard<mutex> lock{ _lock };
+		if (!_run)
+			return false;
+		if (_parkNum > 0) {
+			// 上一个阻塞留下的补偿线程还没休眠, 直接沿用
+			--_parkNum;
+		} else if (_parkedNum > _unparkNum) {
+			++_unparkNum;
+			_park_cv.notify_one();
+		} else if (_pool.size() < THREADPOOL_MAX_NUM) {
+			growLocked(1);
+		} else {
+			return false;
+		}
+		return true;
+	}
+
+	void endBlocking() {
+		lock_guard<mutex> lock{ _lock };
+		++_parkNum;
+	}
+
+	// 多出的线程休眠直到下次阻塞, 调用时必须持有 _lock
+	void park(unique_lock<mutex>& lock) {
+		--_parkNum;
+		++_parkedNum;
+		_idlThrNum--;
+		if (!_tasks.empty())
+			_task_cv.notify_one();
+		_park_cv.wait(lock, [this]{ return _unparkNum > 0 || !_run; });
+		if (_unparkNum > 0)
+			--_unparkNum;
+		--_parkedNum;
+		_idlThrNum++;
+	}
+
+	// 把到期的定时任务转入任务队列, 调用时必须持有 _lock
+	size_t promoteTimers() {
+		if (_timers.empty())
+			return 0;
+		return _timers.popDue(chrono::steady_clock::now(), [this](const Task& task){
+			_tasks.push(task);
+		});
+	}
+
 #ifndef THREADPOOL_AUTO_GROW
 private:
+#else
+public:
 #endif // !THREADPOOL_AUTO_GROW
 
 	//添加指定数量的线程
 	void addThread(unsigned short size)
 	{
-		for (; _pool.size() < THREADPOOL_MAX_NUM && size > 0; --size){
+		lock_guard<mutex> lock{ _lock };
+		growLocked(size);
+	}
+
+private:
+	// _pool 只在持有 _lock 时增长, 工作线程的 blocking_scope 与 commit 可能同时加线程
+	void growLocked(unsigned short size)
+	{
+		for (; _run && _pool.size() < THREADPOOL_MAX_NUM && size > 0; --size){
 
 			//增加线程数量,但不超过 预定义数量 THREADPOOL_MAX_NUM
 			//emplace_back 传入的 参数用于初始化 std::thread
 			_pool.emplace_back( [this]{
+				current() = this;
 				while (_run)
 				{
 					Task task; // 获取一个待执行的 task
 					{
 						unique_lock<mutex> lock{ _lock };
-						_task_cv.wait(lock, [this]{
-								return !_run || !_tasks.empty();
-						}); // wait 直到有 task
+						size_t promoted = promoteTimers();
+						while (_run && (_tasks.empty() || _parkNum > 0)) {
+							// 只让一个空闲线程按最近到期时间等待, 其余无限等待
+							if (_parkNum > 0) {
+								park(lock);
+							} else if (_timers.empty() || _timerWaiter) {
+								_task_cv.wait(lock);
+							} else {
+								_timerWaiter = true;
+								_task_cv.wait_until(lock, _timers.next());
+								_timerWaiter = false;
+							}
+							promoted += promoteTimers();
+						} // wait 直到有 task
 						if (!_run && _tasks.empty())
 							return;
 						task = move(_tasks.front());
 						_tasks.pop();
+						// 其余到期任务交给其他线程, 定时器无人等待时也叫醒一个接手
+						for (; promoted > 1; --promoted)
+							_task_cv.notify_one();
+						if (!_timers.empty() && !_timerWaiter)
+							_task_cv.notify_one();
 					}
 					_idlThrNum--;
 					task();//执行任务
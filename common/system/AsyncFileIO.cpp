@@ -0,0 +1,559 @@
+#include "AsyncFileIO.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <string>
+#include <thread>
+#include "../logcpp/log.h"
+#include "Monitor.h"
+#include "Queue_s.h"
+
+struct AsyncFileIO::Request {
+    enum OP { OPENAT, READ, WRITE, FSYNC, CLOSE };
+
+    OP op_;
+    int fd_;
+    void* buf_;
+    size_t len_;
+    off_t offset_;
+    int flags_;
+    mode_t mode_;
+    std::string path_;
+    Callback callback_;
+    int result_;
+
+    Request(OP op, int fd, const Callback& callback)
+        : op_(op)
+        , fd_(fd)
+        , buf_(NULL)
+        , len_(0)
+        , offset_(0)
+        , flags_(0)
+        , mode_(0)
+        , callback_(callback)
+        , result_(0) {}
+};
+
+class AsyncFileIO::Engine {
+public:
+    explicit Engine(const Executor& executor)
+        : executor_(executor) {}
+    virtual ~Engine() {}
+
+public:
+    virtual bool isUring() const = 0;
+    virtual int registerBuffers(const std::vector<struct iovec>& buffers) = 0;
+    virtual void submit(Request* request) = 0;
+
+protected:
+    /**
+     * Hands the result to the executor and releases the request.
+     */
+    void complete(Request* request) {
+        Callback callback = request->callback_;
+        int result = request->result_;
+        delete request;
+
+        if (!callback) {
+            return;
+        }
+        try {
+            executor_([callback, result]() {
+                callback(result);
+            });
+        } catch (const std::exception& e) {
+            LOG_CXX(LOG_ERROR) << "completion dropped: " << e.what();
+        }
+    }
+
+private:
+    Executor executor_;
+};
+
+/**
+ * io_uring engine. Submissions are entered right away under monitor_, a
+ * reaper thread waits for completions and posts them to the executor.
+ */
+class UringEngine : public AsyncFileIO::Engine {
+public:
+    static UringEngine* create(const Executor& executor, unsigned entries) {
+        UringEngine* engine = new UringEngine(executor);
+        if (!engine->init(entries)) {
+            delete engine;
+            return NULL;
+        }
+        return engine;
+    }
+
+    ~UringEngine() {
+        if (reaper_.joinable()) {
+            {
+                Synchronized s(monitor_);
+                while (inflight_ > 0) {
+                    monitor_.wait();
+                }
+                // a nop without request wakes the reaper up for the last time, it
+                // has to get through or the reaper is never joined
+                for (;;) {
+                    io_uring_sqe* sqe = nextSqe();
+                    sqe->opcode = IORING_OP_NOP;
+                    sqe->user_data = 0;
+                    if (enterSubmitted() == 0) {
+                        break;
+                    }
+                    usleep(ENTER_BACKOFF_US);
+                }
+            }
+            reaper_.join();
+        }
+        cleanup();
+    }
+
+public:
+    virtual bool isUring() const {
+        return true;
+    }
+
+    virtual int registerBuffers(const std::vector<struct iovec>& buffers) {
+        Synchronized s(monitor_);
+        if (!buffers_.empty()) {
+            syscall(__NR_io_uring_register, ringFd_, IORING_UNREGISTER_BUFFERS, NULL, 0);
+            buffers_.clear();
+        }
+        if (buffers.empty()) {
+            return 0;
+        }
+
+        if (syscall(__NR_io_uring_register, ringFd_, IORING_REGISTER_BUFFERS,
+                    &buffers[0], (unsigned)buffers.size()) < 0) {
+            int err = errno;
+            LOG_C(LOG_ERROR, "io_uring_register buffers failed: %s", strerror(err));
+            return -err;
+        }
+        buffers_ = buffers;
+        return 0;
+    }
+
+    virtual void submit(AsyncFileIO::Request* request) {
+        int err;
+        {
+            Synchronized s(monitor_);
+            // never have more in flight than the completion ring holds
+            while (inflight_ >= cqEntries_) {
+                monitor_.wait();
+            }
+
+            io_uring_sqe* sqe = nextSqe();
+            prepare(sqe, request);
+            ++inflight_;
+            err = enterSubmitted();
+            if (err < 0) {
+                --inflight_;
+                monitor_.notifyAll();
+            }
+        }
+        // the kernel never saw it, so it completes here with the error
+        if (err < 0) {
+            request->result_ = err;
+            complete(request);
+        }
+    }
+
+private:
+    explicit UringEngine(const Executor& executor)
+        : AsyncFileIO::Engine(executor)
+        , ringFd_(-1)
+        , sqPtr_(MAP_FAILED)
+        , sqSize_(0)
+        , cqPtr_(MAP_FAILED)
+        , cqSize_(0)
+        , sqes_((io_uring_sqe*)MAP_FAILED)
+        , sqesSize_(0)
+        , cqEntries_(0)
+        , inflight_(0) {}
+
+    bool init(unsigned entries) {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ringFd_ = (int)syscall(__NR_io_uring_setup, entries, &params);
+        if (ringFd_ < 0) {
+            LOG_C(LOG_WARNING, "io_uring_setup failed: %s", strerror(errno));
+            return false;
+        }
+        if (!probe()) {
+            return false;
+        }
+
+        sqSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqSize_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single) {
+            sqSize_ = cqSize_ = (sqSize_ > cqSize_ ? sqSize_ : cqSize_);
+        }
+
+        sqPtr_ = mmap(NULL, sqSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQ_RING);
+        if (sqPtr_ == MAP_FAILED) {
+            return false;
+        }
+        if (single) {
+            cqPtr_ = sqPtr_;
+        } else {
+            cqPtr_ = mmap(NULL, cqSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_CQ_RING);
+            if (cqPtr_ == MAP_FAILED) {
+                return false;
+            }
+        }
+        sqesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+        sqes_ = (io_uring_sqe*)mmap(NULL, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                     ringFd_, IORING_OFF_SQES);
+        if (sqes_ == MAP_FAILED) {
+            return false;
+        }
+
+        char* sq = (char*)sqPtr_;
+        sqHead_ = (unsigned*)(sq + params.sq_off.head);
+        sqTail_ = (unsigned*)(sq + params.sq_off.tail);
+        sqMask_ = (unsigned*)(sq + params.sq_off.ring_mask);
+        sqArray_ = (unsigned*)(sq + params.sq_off.array);
+
+        char* cq = (char*)cqPtr_;
+        cqHead_ = (unsigned*)(cq + params.cq_off.head);
+        cqTail_ = (unsigned*)(cq + params.cq_off.tail);
+        cqMask_ = (unsigned*)(cq + params.cq_off.ring_mask);
+        cqes_ = (io_uring_cqe*)(cq + params.cq_off.cqes);
+        cqEntries_ = params.cq_entries;
+
+        reaper_ = std::thread(&UringEngine::reap, this);
+        return true;
+    }
+
+    /**
+     * Checks that the kernel has every opcode prepare() uses: io_uring came with
+     * 5.1 but plain read/write, openat and close only with 5.6, as did the probe.
+     */
+    bool probe() {
+        static const uint8_t OPS[] = {
+            IORING_OP_READ, IORING_OP_WRITE, IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED,
+            IORING_OP_FSYNC, IORING_OP_OPENAT, IORING_OP_CLOSE, IORING_OP_NOP
+        };
+        const unsigned count = 256;
+        std::vector<char> storage(sizeof(io_uring_probe) + count * sizeof(io_uring_probe_op), 0);
+        io_uring_probe* ops = (io_uring_probe*)&storage[0];
+        if (syscall(__NR_io_uring_register, ringFd_, IORING_REGISTER_PROBE, ops, count) < 0) {
+            LOG_C(LOG_WARNING, "io_uring probe failed, kernel older than 5.6: %s", strerror(errno));
+            return false;
+        }
+        for (size_t i = 0; i < sizeof(OPS) / sizeof(OPS[0]); ++i) {
+            if (OPS[i] > ops->last_op || !(ops->ops[OPS[i]].flags & IO_URING_OP_SUPPORTED)) {
+                LOG_C(LOG_WARNING, "io_uring lacks opcode %d", (int)OPS[i]);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void cleanup() {
+        if (sqes_ != MAP_FAILED) {
+            munmap(sqes_, sqesSize_);
+        }
+        if (cqPtr_ != MAP_FAILED && cqPtr_ != sqPtr_) {
+            munmap(cqPtr_, cqSize_);
+        }
+        if (sqPtr_ != MAP_FAILED) {
+            munmap(sqPtr_, sqSize_);
+        }
+        if (ringFd_ >= 0) {
+            ::close(ringFd_);
+        }
+    }
+
+    /**
+     * Claims the next submission slot. The caller holds monitor_, and since every
+     * submission is entered immediately the ring always has room.
+     */
+    io_uring_sqe* nextSqe() {
+        unsigned tail = *sqTail_;
+        unsigned index = tail & *sqMask_;
+        io_uring_sqe* sqe = &sqes_[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqArray_[index] = index;
+        __atomic_store_n(sqTail_, tail + 1, __ATOMIC_RELEASE);
+        return sqe;
+    }
+
+    /**
+     * Enters the entry nextSqe() just claimed, with monitor_ held. Retries a short
+     * while when the kernel is out of resources, and on failure takes the entry
+     * back off the ring, so that the next submission does not enter it instead
+     * of its own.
+     * \returns 0 or -errno
+     */
+    int enterSubmitted() {
+        int err = 0;
+        for (int attempt = 0; ; ++attempt) {
+            if (syscall(__NR_io_uring_enter, ringFd_, 1, 0, 0, NULL, 0) >= 0) {
+                return 0;
+            }
+            err = errno;
+            if (err == EINTR) {
+                continue;
+            }
+            if ((err == EAGAIN || err == EBUSY) && attempt < ENTER_RETRIES) {
+                // the reaper keeps draining the completion ring meanwhile
+                usleep(ENTER_BACKOFF_US << attempt);
+                continue;
+            }
+            break;
+        }
+        __atomic_store_n(sqTail_, *sqTail_ - 1, __ATOMIC_RELEASE);
+        LOG_C(LOG_ERROR, "io_uring_enter submit failed: %s", strerror(err));
+        return -err;
+    }
+
+    int fixedIndex(const void* buf, size_t len) const {
+        const char* begin = (const char*)buf;
+        for (size_t i = 0; i < buffers_.size(); ++i) {
+            const char* base = (const char*)buffers_[i].iov_base;
+            if (begin >= base && begin + len <= base + buffers_[i].iov_len) {
+                return (int)i;
+            }
+        }
+        return -1;
+    }
+
+    void prepare(io_uring_sqe* sqe, AsyncFileIO::Request* request) {
+        sqe->fd = request->fd_;
+        sqe->user_data = (uint64_t)(uintptr_t)request;
+        switch (request->op_) {
+        case AsyncFileIO::Request::READ:
+        case AsyncFileIO::Request::WRITE: {
+            bool reading = request->op_ == AsyncFileIO::Request::READ;
+            int index = fixedIndex(request->buf_, request->len_);
+            if (index >= 0) {
+                sqe->opcode = reading ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+                sqe->buf_index = (uint16_t)index;
+            } else {
+                sqe->opcode = reading ? IORING_OP_READ : IORING_OP_WRITE;
+            }
+            sqe->addr = (uint64_t)(uintptr_t)request->buf_;
+            sqe->len = (uint32_t)request->len_;
+            sqe->off = (uint64_t)request->offset_;
+            break;
+        }
+        case AsyncFileIO::Request::FSYNC:
+            sqe->opcode = IORING_OP_FSYNC;
+            sqe->fsync_flags = request->flags_;
+            break;
+        case AsyncFileIO::Request::OPENAT:
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->addr = (uint64_t)(uintptr_t)request->path_.c_str();
+            sqe->len = request->mode_;
+            sqe->open_flags = request->flags_;
+            break;
+        case AsyncFileIO::Request::CLOSE:
+            sqe->opcode = IORING_OP_CLOSE;
+            break;
+        }
+    }
+
+    void reap() {
+        bool stop = false;
+        std::vector<AsyncFileIO::Request*> done;
+        while (!stop) {
+            int ret = (int)syscall(__NR_io_uring_enter, ringFd_, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            if (ret < 0 && errno != EINTR) {
+                LOG_C(LOG_ERROR, "io_uring_enter wait failed: %s", strerror(errno));
+            }
+
+            unsigned head = *cqHead_;
+            unsigned tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+            for (; head != tail; ++head) {
+                io_uring_cqe* cqe = &cqes_[head & *cqMask_];
+                AsyncFileIO::Request* request = (AsyncFileIO::Request*)(uintptr_t)cqe->user_data;
+                if (request) {
+                    request->result_ = cqe->res;
+                    done.push_back(request);
+                } else {
+                    stop = true;
+                }
+            }
+            __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+
+            if (!done.empty()) {
+                Synchronized s(monitor_);
+                inflight_ -= (unsigned)done.size();
+                monitor_.notifyAll();
+            }
+            for (size_t i = 0; i < done.size(); ++i) {
+                complete(done[i]);
+            }
+            done.clear();
+        }
+    }
+
+private:
+    // submissions the kernel has no resources for are retried with backoff from
+    // ENTER_BACKOFF_US on, ENTER_RETRIES times before they fail
+    static const int ENTER_RETRIES = 5;
+    static const useconds_t ENTER_BACKOFF_US = 100;
+
+    int ringFd_;
+    void* sqPtr_;
+    size_t sqSize_;
+    void* cqPtr_;
+    size_t cqSize_;
+    io_uring_sqe* sqes_;
+    size_t sqesSize_;
+
+    unsigned* sqHead_;
+    unsigned* sqTail_;
+    unsigned* sqMask_;
+    unsigned* sqArray_;
+    unsigned* cqHead_;
+    unsigned* cqTail_;
+    unsigned* cqMask_;
+    io_uring_cqe* cqes_;
+    unsigned cqEntries_;
+
+    Monitor monitor_;
+    unsigned inflight_;
+    std::vector<struct iovec> buffers_;
+    std::thread reaper_;
+};
+
+/**
+ * Fallback engine: one I/O thread runs the plain syscalls in submission order.
+ * Regular files always poll as ready, so waiting for readiness would not help;
+ * the point is only to keep the blocking calls off the pool threads.
+ */
+class SyscallEngine : public AsyncFileIO::Engine {
+public:
+    explicit SyscallEngine(const Executor& executor)
+        : AsyncFileIO::Engine(executor)
+        , worker_(&SyscallEngine::work, this) {}
+
+    ~SyscallEngine() {
+        queue_.push(NULL);
+        worker_.join();
+    }
+
+public:
+    virtual bool isUring() const {
+        return false;
+    }
+
+    virtual int registerBuffers(const std::vector<struct iovec>&) {
+        return 0;
+    }
+
+    virtual void submit(AsyncFileIO::Request* request) {
+        queue_.push(request);
+    }
+
+private:
+    void work() {
+        for (;;) {
+            bool bstat = false;
+            AsyncFileIO::Request* request = queue_.pop_front(bstat);
+            if (!bstat) {
+                continue;
+            }
+            if (!request) {
+                break;
+            }
+            execute(request);
+            complete(request);
+        }
+    }
+
+    static void execute(AsyncFileIO::Request* request) {
+        ssize_t ret = -1;
+        switch (request->op_) {
+        case AsyncFileIO::Request::READ:
+            ret = pread(request->fd_, request->buf_, request->len_, request->offset_);
+            break;
+        case AsyncFileIO::Request::WRITE:
+            ret = pwrite(request->fd_, request->buf_, request->len_, request->offset_);
+            break;
+        case AsyncFileIO::Request::FSYNC:
+            ret = (request->flags_ & IORING_FSYNC_DATASYNC) ? fdatasync(request->fd_) : ::fsync(request->fd_);
+            break;
+        case AsyncFileIO::Request::OPENAT:
+            ret = ::openat(request->fd_, request->path_.c_str(), request->flags_, request->mode_);
+            break;
+        case AsyncFileIO::Request::CLOSE:
+            ret = ::close(request->fd_);
+            break;
+        }
+        request->result_ = ret < 0 ? -errno : (int)ret;
+    }
+
+private:
+    Queue_s<AsyncFileIO::Request*> queue_;
+    std::thread worker_;
+};
+
+AsyncFileIO::AsyncFileIO(Executor executor, unsigned entries, bool fallback)
+    : executor_(executor)
+    , engine_(NULL) {
+    if (!fallback) {
+        engine_ = UringEngine::create(executor_, entries);
+    }
+    if (!engine_) {
+        engine_ = new SyscallEngine(executor_);
+    }
+}
+
+AsyncFileIO::~AsyncFileIO() {
+    delete engine_;
+}
+
+bool AsyncFileIO::isUring() const {
+    return engine_->isUring();
+}
+
+int AsyncFileIO::registerBuffers(const std::vector<struct iovec>& buffers) {
+    return engine_->registerBuffers(buffers);
+}
+
+void AsyncFileIO::openat(int dirfd, const char* path, int flags, mode_t mode, const Callback& callback) {
+    Request* request = new Request(Request::OPENAT, dirfd, callback);
+    request->path_ = path;
+    request->flags_ = flags;
+    request->mode_ = mode;
+    submit(request);
+}
+
+void AsyncFileIO::read(int fd, void* buf, size_t len, off_t offset, const Callback& callback) {
+    Request* request = new Request(Request::READ, fd, callback);
+    request->buf_ = buf;
+    request->len_ = len;
+    request->offset_ = offset;
+    submit(request);
+}
+
+void AsyncFileIO::write(int fd, const void* buf, size_t len, off_t offset, const Callback& callback) {
+    Request* request = new Request(Request::WRITE, fd, callback);
+    request->buf_ = const_cast<void*>(buf);
+    request->len_ = len;
+    request->offset_ = offset;
+    submit(request);
+}
+
+void AsyncFileIO::fsync(int fd, bool dataOnly, const Callback& callback) {
+    Request* request = new Request(Request::FSYNC, fd, callback);
+    request->flags_ = dataOnly ? IORING_FSYNC_DATASYNC : 0;
+    submit(request);
+}
+
+void AsyncFileIO::close(int fd, const Callback& callback) {
+    submit(new Request(Request::CLOSE, fd, callback));
+}
+
+void AsyncFileIO::submit(Request* request) {
+    engine_->submit(request);
+}
@@ -0,0 +1,85 @@
+#ifndef __CF_ASYNC_FILE_IO_H
+#define __CF_ASYNC_FILE_IO_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <functional>
+#include <vector>
+#include "Executor.h"
+
+/**
+ * Asynchronous file I/O service.
+ *
+ * Operations are submitted to an io_uring and return immediately; the
+ * kernel performs them without occupying a pool thread. Each completion
+ * is delivered as a continuation on the given Executor, i.e. on a
+ * std::threadpool or ThreadManager worker, with the syscall style result:
+ * the byte count or file descriptor on success, -errno on failure.
+ *
+ * Buffers passed to registerBuffers() are pinned once; reads and writes
+ * that fall inside a registered buffer are issued as fixed-buffer
+ * operations so the kernel does not map the pages again for every call.
+ *
+ * When io_uring is not available (old kernel, seccomp) the service falls
+ * back to a single I/O thread issuing the plain syscalls, with the same
+ * completion semantics.
+ *
+ * The caller keeps buffers and paths valid until the callback runs.
+ */
+class AsyncFileIO {
+public:
+    typedef std::function<void(int result)> Callback;
+
+public:
+    /**
+     * \param executor  where completions run
+     * \param entries   submission queue size, also bounds the in-flight operations
+     * \param fallback  skip io_uring and use the I/O thread
+     */
+    explicit AsyncFileIO(Executor executor, unsigned entries = 256, bool fallback = false);
+
+    /**
+     * Waits for the in-flight operations to complete, then stops.
+     */
+    ~AsyncFileIO();
+
+public:
+    /**
+     * \returns true if operations go through io_uring
+     */
+    bool isUring() const;
+
+    /**
+     * Registers the buffers used for fixed-buffer reads and writes, replacing
+     * any previous registration. Must not be called with operations in flight.
+     * \returns 0 or -errno
+     */
+    int registerBuffers(const std::vector<struct iovec>& buffers);
+
+    void openat(int dirfd, const char* path, int flags, mode_t mode, const Callback& callback);
+
+    void read(int fd, void* buf, size_t len, off_t offset, const Callback& callback);
+
+    void write(int fd, const void* buf, size_t len, off_t offset, const Callback& callback);
+
+    void fsync(int fd, bool dataOnly, const Callback& callback);
+
+    void close(int fd, const Callback& callback);
+
+public:
+    struct Request;
+    class Engine;
+
+private:
+    void submit(Request* request);
+
+    AsyncFileIO(const AsyncFileIO&);
+    AsyncFileIO& operator=(const AsyncFileIO&);
+
+private:
+    Executor executor_;
+    Engine* engine_;
+};
+
+#endif
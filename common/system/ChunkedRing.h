@@ -0,0 +1,230 @@
+#ifndef __CF_CHUNKED_RING_H
+#define __CF_CHUNKED_RING_H
+
+#include <stddef.h>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/**
+ * FIFO sequence stored in fixed-size chunks of slots, for use as the Sequence
+ * of std::queue (and so of Queue_s): it has front(), back(), push_back(),
+ * emplace_back(), pop_front(), size() and swap().
+ *
+ * Unlike std::list it does not allocate per item, and unlike std::deque it does
+ * not give chunks back as soon as they are drained: up to SPARE_MAX are kept for
+ * reuse, so a queue whose length swings by up to that much stops allocating once
+ * warmed up.
+ */
+template <class T>
+class ChunkedRing {
+public:
+    typedef T value_type;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef size_t size_type;
+
+    // about 1KB per chunk, at least 16 slots
+    static const size_t SLOTS = sizeof(T) * 16 >= 1024 ? 16 : 1024 / sizeof(T);
+    // drained chunks kept for reuse, about 64KB worth and at least 4
+    static const size_t SPARE_MAX = sizeof(T) * SLOTS * 4 >= 65536 ? 4 : 65536 / (sizeof(T) * SLOTS);
+
+public:
+    ChunkedRing()
+        : head_(NULL)
+        , headIndex_(0)
+        , tail_(NULL)
+        , tailIndex_(0)
+        , size_(0)
+        , spare_(NULL)
+        , spareCount_(0) {}
+
+    ChunkedRing(const ChunkedRing& other)
+        : head_(NULL)
+        , headIndex_(0)
+        , tail_(NULL)
+        , tailIndex_(0)
+        , size_(0)
+        , spare_(NULL)
+        , spareCount_(0) {
+        other.forEach([this](const T& val) {
+            push_back(val);
+        });
+    }
+
+    ChunkedRing(ChunkedRing&& other)
+        : head_(NULL)
+        , headIndex_(0)
+        , tail_(NULL)
+        , tailIndex_(0)
+        , size_(0)
+        , spare_(NULL)
+        , spareCount_(0) {
+        swap(other);
+    }
+
+    ChunkedRing& operator=(const ChunkedRing& other) {
+        if (this != &other) {
+            ChunkedRing(other).swap(*this);
+        }
+        return *this;
+    }
+
+    ChunkedRing& operator=(ChunkedRing&& other) {
+        ChunkedRing(std::move(other)).swap(*this);
+        return *this;
+    }
+
+    ~ChunkedRing() {
+        while (size_ > 0) {
+            pop_front();
+        }
+        freeChunks(head_);
+        freeChunks(spare_);
+    }
+
+public:
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    T& front() {
+        return *slot(head_, headIndex_);
+    }
+
+    const T& front() const {
+        return *slot(head_, headIndex_);
+    }
+
+    T& back() {
+        // a full tail chunk stays the tail until the next push, so tailIndex_ > 0
+        return *slot(tail_, tailIndex_ - 1);
+    }
+
+    const T& back() const {
+        return *slot(tail_, tailIndex_ - 1);
+    }
+
+    void push_back(const T& val) {
+        emplace_back(val);
+    }
+
+    void push_back(T&& val) {
+        emplace_back(std::move(val));
+    }
+
+    template <class... Args>
+    void emplace_back(Args&&... args) {
+        if (!tail_) {
+            head_ = tail_ = newChunk();
+            headIndex_ = tailIndex_ = 0;
+        } else if (tailIndex_ == SLOTS) {
+            Chunk* chunk = newChunk();
+            tail_->next_ = chunk;
+            tail_ = chunk;
+            tailIndex_ = 0;
+        }
+        new (slot(tail_, tailIndex_)) T(std::forward<Args>(args)...);
+        ++tailIndex_;
+        ++size_;
+    }
+
+    void pop_front() {
+        slot(head_, headIndex_)->~T();
+        --size_;
+        if (++headIndex_ == SLOTS || size_ == 0) {
+            if (head_ == tail_) {
+                // drained, start over at the beginning of the chunk
+                headIndex_ = tailIndex_ = 0;
+            } else {
+                Chunk* chunk = head_;
+                head_ = head_->next_;
+                headIndex_ = 0;
+                recycle(chunk);
+            }
+        }
+    }
+
+    void swap(ChunkedRing& other) {
+        std::swap(head_, other.head_);
+        std::swap(headIndex_, other.headIndex_);
+        std::swap(tail_, other.tail_);
+        std::swap(tailIndex_, other.tailIndex_);
+        std::swap(size_, other.size_);
+        std::swap(spare_, other.spare_);
+        std::swap(spareCount_, other.spareCount_);
+    }
+
+private:
+    struct Chunk {
+        Chunk* next_;
+        typename std::aligned_storage<sizeof(T), std::alignment_of<T>::value>::type slots_[SLOTS];
+    };
+
+    static T* slot(Chunk* chunk, size_t index) {
+        return reinterpret_cast<T*>(&chunk->slots_[index]);
+    }
+
+    template <class F>
+    void forEach(F f) const {
+        Chunk* chunk = head_;
+        size_t index = headIndex_;
+        for (size_t i = 0; i < size_; ++i) {
+            if (index == SLOTS) {
+                chunk = chunk->next_;
+                index = 0;
+            }
+            f(*slot(chunk, index++));
+        }
+    }
+
+    Chunk* newChunk() {
+        Chunk* chunk = spare_;
+        if (chunk) {
+            spare_ = chunk->next_;
+            --spareCount_;
+        } else {
+            chunk = static_cast<Chunk*>(::operator new(sizeof(Chunk)));
+        }
+        chunk->next_ = NULL;
+        return chunk;
+    }
+
+    void recycle(Chunk* chunk) {
+        if (spareCount_ < SPARE_MAX) {
+            chunk->next_ = spare_;
+            spare_ = chunk;
+            ++spareCount_;
+        } else {
+            ::operator delete(chunk);
+        }
+    }
+
+    static void freeChunks(Chunk* chunk) {
+        while (chunk) {
+            Chunk* next = chunk->next_;
+            ::operator delete(chunk);
+            chunk = next;
+        }
+    }
+
+private:
+    Chunk* head_;           // chunk of front(), NULL until the first push
+    size_t headIndex_;
+    Chunk* tail_;           // chunk of the next push
+    size_t tailIndex_;      // next slot to push to in tail_, SLOTS when it is full
+    size_t size_;
+    Chunk* spare_;          // drained chunks, linked through next_
+    size_t spareCount_;
+};
+
+template <class T>
+inline void swap(ChunkedRing<T>& a, ChunkedRing<T>& b) {
+    a.swap(b);
+}
+
+#endif
@@ -0,0 +1,272 @@
+#ifndef __CF_CONCURRENT_PRIORITY_QUEUE_H
+#define __CF_CONCURRENT_PRIORITY_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+#include "EventCount.h"
+#include "MPMCRing.h"
+#include "Mutex.h"
+
+/**
+ * Blocking priority queue for many threads, a replacement for Priority_Queue_s
+ * with the same push()/pop_front(bstat, seconds) surface. As with
+ * std::priority_queue, the greatest item under Compare comes out first.
+ *
+ * Items are spread over several sequential heaps, each behind its own lock and
+ * on its own cache lines, so pushes and pops to different heaps do not contend
+ * and the sift work is done outside any global critical section. A push goes to
+ * a random heap that is not locked at the moment.
+ *
+ * Two modes of popping:
+ *  - RELAXED, a MultiQueue: pops the better top of two random heaps. Takes at
+ *    most two locks, but an item may come out before a somewhat greater one
+ *    (about heap count places early, on average). Good for schedulers.
+ *  - STRICT: walks all the heaps, holding the lock of the best top found so far,
+ *    and pops the greatest item. Pops cost one lock per non-empty heap, pushes
+ *    still scale. Exact as long as no push overtakes the walk.
+ *
+ * pop_front() waits once if the queue is empty, like Priority_Queue_s does,
+ * seconds being handed over as milliseconds, 0 for no limit. There is no swap().
+ */
+template <class T, class Compare = std::less<T> >
+class ConcurrentPriorityQueue {
+public:
+    enum Mode {
+        STRICT,
+        RELAXED
+    };
+
+    /**
+     * \param heaps  0 for twice the CPU count in RELAXED mode, the CPU count in
+     *               STRICT mode
+     */
+    explicit ConcurrentPriorityQueue(Mode mode = RELAXED, size_t heaps = 0, const Compare& comp = Compare())
+        : mode_(mode)
+        , heapCount_(heaps > 0 ? heaps : defaultHeaps(mode))
+        , heaps_(new Heap[heapCount_])
+        , comp_(comp) {}
+
+    ConcurrentPriorityQueue(const ConcurrentPriorityQueue&) = delete;
+    ConcurrentPriorityQueue& operator=(const ConcurrentPriorityQueue&) = delete;
+
+public:
+    void push(const T& val) {
+        T copy(val);
+        push(std::move(copy));
+    }
+
+    void push(T&& val) {
+        Heap& heap = lockForPush();
+        heap.items_.push_back(std::move(val));
+        std::push_heap(heap.items_.begin(), heap.items_.end(), comp_);
+        heap.size_.store(heap.items_.size(), std::memory_order_relaxed);
+        heap.mutex_.unlock();
+        notEmpty_.notify();
+    }
+
+    /**
+     * Waits once for an item if the queue is empty, at most seconds (milliseconds,
+     * see above). wake_all() ends the wait early.
+     * \param[out] bstat  false if there is still no item, and T() is returned
+     */
+    T pop_front(bool &bstat, double seconds = 0) {
+        T val = T();
+        bstat = tryPop(val);
+        if (!bstat) {
+            EventCount::Key key = notEmpty_.prepareWait();
+            bstat = tryPop(val);
+            if (bstat) {
+                notEmpty_.cancelWait();
+            } else {
+                int64_t timeout_ms = (int64_t)seconds;
+                notEmpty_.wait(key, timeout_ms > 0 ? timeout_ms * 1000000 : 0);
+                bstat = tryPop(val);
+            }
+        }
+        return val;
+    }
+
+    /**
+     * Never blocks.
+     * \returns false if every heap is empty
+     */
+    bool tryPop(T& val) {
+        return mode_ == RELAXED ? popRelaxed(val) : popStrict(val);
+    }
+
+    /**
+     * A snapshot, the heaps are not counted at the same moment.
+     */
+    size_t size() const {
+        size_t total = 0;
+        for (size_t i = 0; i < heapCount_; ++i) {
+            total += heaps_[i].size_.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    Mode mode() const {
+        return mode_;
+    }
+
+    size_t heapCount() const {
+        return heapCount_;
+    }
+
+    /**
+     * Wakes the threads blocked in pop_front().
+     */
+    void wake_all() {
+        notEmpty_.notifyAll();
+    }
+
+private:
+    struct Heap {
+        Heap()
+            : size_(0) {}
+
+        Mutex mutex_;
+        std::vector<T> items_;          // binary heap under Compare
+        std::atomic<size_t> size_;      // items_.size(), readable without the lock
+        char pad_[CF_CACHE_LINE_SIZE];
+    };
+
+    // random pairs tried before a relaxed pop falls back to a walk
+    static const int RELAXED_TRIES = 4;
+
+    static size_t defaultHeaps(Mode mode) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        size_t heaps = cpus > 0 ? (size_t)cpus : 1;
+        return mode == RELAXED ? heaps * 2 : heaps;
+    }
+
+    /**
+     * xorshift64*, one generator per thread.
+     */
+    static size_t random() {
+        static thread_local uint64_t state = 0;
+        if (state == 0) {
+            state = reinterpret_cast<uintptr_t>(&state) ^ 0x9e3779b97f4a7c15ULL;
+        }
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return (size_t)((state * 0x2545f4914f6cdd1dULL) >> 32);
+    }
+
+    Heap& randomHeap() {
+        return heaps_[random() % heapCount_];
+    }
+
+    /**
+     * Locks a random heap, skipping the locked ones for a while.
+     */
+    Heap& lockForPush() {
+        for (size_t i = 1; i < heapCount_; ++i) {
+            Heap& heap = randomHeap();
+            if (heap.mutex_.trylock()) {
+                return heap;
+            }
+        }
+        Heap& heap = randomHeap();
+        heap.mutex_.lock();
+        return heap;
+    }
+
+    /**
+     * \returns whether the top of a, whose lock is held, comes before that of b
+     */
+    bool better(Heap* a, Heap* b) const {
+        return !a->items_.empty() && (b->items_.empty() || !comp_(a->items_.front(), b->items_.front()));
+    }
+
+    /**
+     * Pops the top of heap, whose lock is held and which is not empty.
+     */
+    void take(Heap& heap, T& val) {
+        std::pop_heap(heap.items_.begin(), heap.items_.end(), comp_);
+        val = std::move(heap.items_.back());
+        heap.items_.pop_back();
+        heap.size_.store(heap.items_.size(), std::memory_order_relaxed);
+    }
+
+    bool popRelaxed(T& val) {
+        for (int i = 0; i < RELAXED_TRIES; ++i) {
+            Heap* a = &randomHeap();
+            Heap* b = &randomHeap();
+            if (a->size_.load(std::memory_order_relaxed) == 0) {
+                std::swap(a, b);
+            }
+            if (a->size_.load(std::memory_order_relaxed) == 0 || !a->mutex_.trylock()) {
+                continue;
+            }
+            // settle for a alone if b is empty or busy
+            if (b == a || b->size_.load(std::memory_order_relaxed) == 0 || !b->mutex_.trylock()) {
+                b = NULL;
+            }
+            Heap* from = b && better(b, a) ? b : a;
+            bool found = !from->items_.empty();
+            if (found) {
+                take(*from, val);
+            }
+            if (b) {
+                b->mutex_.unlock();
+            }
+            a->mutex_.unlock();
+            if (found) {
+                return true;
+            }
+        }
+        // nearly empty or heavily contended, the walk finds an item if there is one
+        return popStrict(val);
+    }
+
+    bool popStrict(T& val) {
+        // locks are taken in index order, and relaxed pops only try theirs, so
+        // holding the best heap while locking the next one cannot deadlock
+        Heap* best = NULL;
+        for (size_t i = 0; i < heapCount_; ++i) {
+            Heap* heap = &heaps_[i];
+            if (heap->size_.load(std::memory_order_relaxed) == 0) {
+                continue;
+            }
+            heap->mutex_.lock();
+            if (!best || better(heap, best)) {
+                std::swap(heap, best);
+            }
+            if (heap) {
+                heap->mutex_.unlock();
+            }
+        }
+        if (!best) {
+            return false;
+        }
+        bool found = !best->items_.empty();
+        if (found) {
+            take(*best, val);
+        }
+        best->mutex_.unlock();
+        return found;
+    }
+
+private:
+    const Mode mode_;
+    const size_t heapCount_;
+    std::unique_ptr<Heap[]> heaps_;
+    Compare comp_;
+    char pad_[CF_CACHE_LINE_SIZE];
+    EventCount notEmpty_;               // pop_front() waits on it
+};
+
+#endif
@@ -0,0 +1,146 @@
+#ifndef __CF_EPOCH_H
+#define __CF_EPOCH_H
+
+#include <stdint.h>
+#include <atomic>
+#include "MPMCRing.h"
+
+/**
+ * Epoch-based reclamation for lock-free structures: a node unlinked at epoch e
+ * can be reused or freed once the global epoch reached e + 2, because by then
+ * every thread that could still hold a pointer to it has left its guard.
+ *
+ *     {
+ *         Epoch::Guard guard;
+ *         Node* node = head_.load();       // safe to dereference until ~Guard
+ *         ...
+ *     }
+ *     // after unlinking a node
+ *     retired.push_back(std::make_pair(node, Epoch::current()));
+ *     ...
+ *     if (Epoch::tryAdvance() >= retired.front().second + 2) reuse it
+ *
+ * Each thread gets a record on its first guard, handed back when it exits and
+ * reused by later threads. Entering a guard costs a store and a fence, guards
+ * nest for free.
+ */
+class Epoch {
+private:
+    struct Record;
+
+public:
+    class Guard {
+    public:
+        Guard()
+            : record_(self()) {
+            if (record_->depth_++ == 0) {
+                record_->epoch_.store(global().load(std::memory_order_relaxed), std::memory_order_relaxed);
+                // pairs with tryAdvance(): it sees this thread, or this sees its epoch
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+            }
+        }
+
+        ~Guard() {
+            if (--record_->depth_ == 0) {
+                record_->epoch_.store(0, std::memory_order_release);
+            }
+        }
+
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+
+    private:
+        Record* record_;
+    };
+
+    static uint64_t current() {
+        return global().load(std::memory_order_acquire);
+    }
+
+    /**
+     * Moves the epoch on if every thread inside a guard entered it at the current
+     * one, which happens at most once per call.
+     * \returns the epoch afterwards
+     */
+    static uint64_t tryAdvance() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        uint64_t epoch = global().load(std::memory_order_acquire);
+        for (Record* record = records().load(std::memory_order_acquire); record; record = record->next_) {
+            uint64_t seen = record->epoch_.load(std::memory_order_acquire);
+            if (seen != 0 && seen != epoch) {
+                return epoch;
+            }
+        }
+        if (global().compare_exchange_strong(epoch, epoch + 1, std::memory_order_acq_rel)) {
+            return epoch + 1;
+        }
+        return epoch;   // advanced by another thread, epoch was updated
+    }
+
+private:
+    struct Record {
+        Record()
+            : epoch_(0)
+            , used_(true)
+            , depth_(0)
+            , next_(NULL) {}
+
+        std::atomic<uint64_t> epoch_;   // epoch the owner entered its guard at, 0 outside
+        std::atomic<bool> used_;        // owned by a live thread
+        unsigned depth_;                // nested guards, owner only
+        Record* next_;                  // records are never unlinked
+        char pad_[CF_CACHE_LINE_SIZE];
+    };
+
+    /**
+     * Hands the record of a thread back when it exits.
+     */
+    struct Owner {
+        Owner()
+            : record_(NULL) {}
+
+        ~Owner() {
+            if (record_) {
+                record_->used_.store(false, std::memory_order_release);
+            }
+        }
+
+        Record* record_;
+    };
+
+    static std::atomic<uint64_t>& global() {
+        static std::atomic<uint64_t> epoch(1);
+        return epoch;
+    }
+
+    static std::atomic<Record*>& records() {
+        static std::atomic<Record*> head(NULL);
+        return head;
+    }
+
+    static Record* self() {
+        static thread_local Owner owner;
+        if (!owner.record_) {
+            owner.record_ = acquire();
+        }
+        return owner.record_;
+    }
+
+    static Record* acquire() {
+        for (Record* record = records().load(std::memory_order_acquire); record; record = record->next_) {
+            bool used = false;
+            if (!record->used_.load(std::memory_order_relaxed) &&
+                record->used_.compare_exchange_strong(used, true, std::memory_order_acquire)) {
+                return record;
+            }
+        }
+        Record* record = new Record();
+        Record* head = records().load(std::memory_order_relaxed);
+        do {
+            record->next_ = head;
+        } while (!records().compare_exchange_weak(head, record, std::memory_order_release));
+        return record;
+    }
+};
+
+#endif
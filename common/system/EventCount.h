@@ -0,0 +1,124 @@
+#ifndef __CF_EVENT_COUNT_H
+#define __CF_EVENT_COUNT_H
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+
+/**
+ * Event count: lets threads block on a condition of a lock-free structure
+ * without a mutex, and costs the notifying side a fence and a load while
+ * nobody waits.
+ *
+ * A waiter announces itself with prepareWait(), checks its condition again, and
+ * then either cancelWait()s or wait()s on the key it got. A notification that
+ * comes after prepareWait() bumps the epoch, so wait() returns at once instead
+ * of missing it:
+ *
+ *     while (!ring.tryPop(value)) {
+ *         EventCount::Key key = notEmpty.prepareWait();
+ *         if (ring.tryPop(value)) {
+ *             notEmpty.cancelWait();
+ *             break;
+ *         }
+ *         notEmpty.wait(key);
+ *     }
+ *
+ * The notifying side changes the condition first, then calls notify().
+ */
+class EventCount {
+public:
+    typedef uint32_t Key;
+
+    EventCount()
+        : epoch_(0)
+        , state_(0) {}
+
+    EventCount(const EventCount&) = delete;
+    EventCount& operator=(const EventCount&) = delete;
+
+public:
+    Key prepareWait() {
+        state_.fetch_add(WAITER, std::memory_order_seq_cst);
+        return epoch_.load(std::memory_order_acquire);
+    }
+
+    void cancelWait() {
+        leave();
+    }
+
+    /**
+     * Blocks until a notification after the prepareWait() that returned key, or
+     * until timeout_ns passed if it is positive, and ends the wait.
+     * \returns false on timeout
+     */
+    bool wait(Key key, int64_t timeout_ns = 0) {
+        bool notified = true;
+        if (epoch_.load(std::memory_order_acquire) == key) {
+            struct timespec ts;
+            if (timeout_ns > 0) {
+                ts.tv_sec = timeout_ns / 1000000000;
+                ts.tv_nsec = timeout_ns % 1000000000;
+            }
+            // spurious wakeups and signals count as notifications, the caller checks again
+            notified = futex(FUTEX_WAIT_PRIVATE, key, timeout_ns > 0 ? &ts : NULL) == 0 || errno != ETIMEDOUT;
+        }
+        leave();
+        return notified;
+    }
+
+    /**
+     * Wakes one waiter, unless every waiter has been woken already and just did not
+     * get to run yet: a burst of notifications costs a single system call.
+     */
+    void notify() {
+        // pairs with prepareWait(): either the waiter sees the new condition or this
+        // sees the waiter
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        uint64_t state = state_.load(std::memory_order_relaxed);
+        do {
+            if ((state >> 32) <= (uint32_t)state) {
+                return;
+            }
+        } while (!state_.compare_exchange_weak(state, state + 1, std::memory_order_relaxed));
+        epoch_.fetch_add(1, std::memory_order_release);
+        futex(FUTEX_WAKE_PRIVATE, 1, NULL);
+    }
+
+    void notifyAll() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if ((state_.load(std::memory_order_relaxed) >> 32) != 0) {
+            epoch_.fetch_add(1, std::memory_order_release);
+            futex(FUTEX_WAKE_PRIVATE, INT_MAX, NULL);
+        }
+    }
+
+private:
+    static const uint64_t WAITER = (uint64_t)1 << 32;
+
+    /**
+     * A waiter leaves, taking one of the pending wakeups along if there is any. Both
+     * counts change at once, so the woken ones never outnumber the waiters.
+     */
+    void leave() {
+        uint64_t state = state_.load(std::memory_order_relaxed);
+        while (!state_.compare_exchange_weak(state, state - WAITER - ((uint32_t)state > 0 ? 1 : 0),
+                                             std::memory_order_relaxed)) {
+        }
+    }
+
+    long futex(int op, uint32_t value, const struct timespec* timeout) {
+        return syscall(SYS_futex, reinterpret_cast<uint32_t*>(&epoch_), op, value, timeout, NULL, 0);
+    }
+
+private:
+    std::atomic<uint32_t> epoch_;       // futex word, bumped by every notification that wakes
+    std::atomic<uint64_t> state_;       // waiters in the high half, of which woken in the low half
+};
+
+#endif
@@ -0,0 +1,344 @@
+#include "EventLoop.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include "../logcpp/log.h"
+
+#define EVENT_LOOP_MAX_EVENTS 64
+
+EventLoop::EventLoop(Executor executor)
+    : executor_(executor)
+    , epollFd_(epoll_create1(EPOLL_CLOEXEC))
+    , wakeupFd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+    , stopping_(false)
+    , dispatching_(0) {
+    if (epollFd_ < 0 || wakeupFd_ < 0) {
+        LOG_C(LOG_ERROR, "event loop setup failed: %s", strerror(errno));
+        return;
+    }
+
+    // the wakeup descriptor stays level-triggered and is drained by the loop itself
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = wakeupFd_;
+    if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, wakeupFd_, &ev) != 0) {
+        LOG_C(LOG_ERROR, "epoll_ctl add eventfd failed: %s", strerror(errno));
+    }
+}
+
+EventLoop::~EventLoop() {
+    stop();
+    {
+        Synchronized s(monitor_);
+        while (dispatching_ > 0) {
+            monitor_.wait();
+        }
+        channels_.clear();
+    }
+    if (wakeupFd_ >= 0) {
+        ::close(wakeupFd_);
+    }
+    if (epollFd_ >= 0) {
+        ::close(epollFd_);
+    }
+}
+
+bool EventLoop::add(int fd, uint32_t events, const Handler& handler) {
+    std::shared_ptr<Channel> channel(new Channel());
+    channel->fd_ = fd;
+    channel->events_ = events;
+    channel->removed_ = false;
+    channel->busy_ = false;
+    channel->pending_ = 0;
+    channel->handler_ = handler;
+
+    Synchronized s(monitor_);
+    if (channels_.find(fd) != channels_.end()) {
+        LOG_C(LOG_ERROR, "fd %d is already registered", fd);
+        return false;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events | EPOLLET | EPOLLONESHOT;
+    ev.data.fd = fd;
+    if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        LOG_C(LOG_ERROR, "epoll_ctl add fd %d failed: %s", fd, strerror(errno));
+        return false;
+    }
+    channels_[fd] = channel;
+    return true;
+}
+
+bool EventLoop::modify(int fd, uint32_t events) {
+    Synchronized s(monitor_);
+    std::map<int, std::shared_ptr<Channel> >::iterator it = channels_.find(fd);
+    if (it == channels_.end()) {
+        return false;
+    }
+    it->second->events_ = events;
+    // while a handler runs the descriptor stays disarmed, finish() arms it
+    if (it->second->busy_ || stopping_) {
+        return true;
+    }
+    return arm(it->second);
+}
+
+void EventLoop::remove(int fd) {
+    Synchronized s(monitor_);
+    std::map<int, std::shared_ptr<Channel> >::iterator it = channels_.find(fd);
+    if (it == channels_.end()) {
+        return;
+    }
+    it->second->removed_ = true;
+    epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, NULL);
+    channels_.erase(it);
+}
+
+void EventLoop::run() {
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+    for (;;) {
+        {
+            Synchronized s(monitor_);
+            if (stopping_) {
+                break;
+            }
+        }
+
+        int count = epoll_wait(epollFd_, events, EVENT_LOOP_MAX_EVENTS, -1);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG_C(LOG_ERROR, "epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < count; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == wakeupFd_) {
+                uint64_t value;
+                while (::read(wakeupFd_, &value, sizeof(value)) > 0) {
+                }
+                continue;
+            }
+
+            std::shared_ptr<Channel> channel;
+            {
+                Synchronized s(monitor_);
+                std::map<int, std::shared_ptr<Channel> >::iterator it = channels_.find(fd);
+                if (it == channels_.end()) {
+                    continue;
+                }
+                channel = it->second;
+                if (channel->busy_) {
+                    // re-armed by modify() while its handler runs, never run it twice at once
+                    channel->pending_ |= events[i].events;
+                    continue;
+                }
+                channel->busy_ = true;
+                ++dispatching_;
+            }
+            dispatch(channel, events[i].events);
+        }
+    }
+}
+
+void EventLoop::stop() {
+    {
+        Synchronized s(monitor_);
+        stopping_ = true;
+    }
+    wakeup();
+}
+
+void EventLoop::wakeup() {
+    uint64_t one = 1;
+    if (::write(wakeupFd_, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN) {
+        LOG_C(LOG_ERROR, "eventfd write failed: %s", strerror(errno));
+    }
+}
+
+void EventLoop::dispatch(const std::shared_ptr<Channel>& channel, uint32_t events) {
+    std::shared_ptr<Dispatch> handling(new Dispatch(this, channel, events));
+    try {
+        executor_([handling]() {
+            handling->run();
+        });
+    } catch (const std::exception& e) {
+        LOG_CXX(LOG_ERROR) << "dispatch of fd " << channel->fd_ << " failed: " << e.what();
+    } catch (...) {
+        LOG_CXX(LOG_ERROR) << "dispatch of fd " << channel->fd_ << " failed";
+    }
+}
+
+void EventLoop::Dispatch::run() {
+    try {
+        channel_->handler_(channel_->fd_, events_);
+    } catch (const std::exception& e) {
+        LOG_CXX(LOG_ERROR) << "handler of fd " << channel_->fd_ << " raised an exception:" << e.what();
+    } catch (...) {
+        LOG_CXX(LOG_ERROR) << "handler of fd " << channel_->fd_ << " raised an unknown exception";
+    }
+    done_ = true;
+    loop_->finish(channel_, true);
+}
+
+EventLoop::Dispatch::~Dispatch() {
+    if (!done_) {
+        LOG_C(LOG_WARNING, "handler of fd %d dropped by the executor, the fd stays disarmed", channel_->fd_);
+        loop_->finish(channel_, false);
+    }
+}
+
+void EventLoop::finish(const std::shared_ptr<Channel>& channel, bool rearm) {
+    uint32_t pending = 0;
+    {
+        Synchronized s(monitor_);
+        if (rearm && !channel->removed_ && !stopping_) {
+            if (channel->pending_ != 0) {
+                pending = channel->pending_;
+            } else {
+                arm(channel);
+            }
+        }
+        channel->pending_ = 0;
+        if (pending == 0) {
+            channel->busy_ = false;
+            if (--dispatching_ == 0) {
+                monitor_.notifyAll();
+            }
+        }
+    }
+    // still busy and counted, the events that came during the handler go next
+    if (pending != 0) {
+        dispatch(channel, pending);
+    }
+}
+
+bool EventLoop::arm(const std::shared_ptr<Channel>& channel) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = channel->events_ | EPOLLET | EPOLLONESHOT;
+    ev.data.fd = channel->fd_;
+    if (epoll_ctl(epollFd_, EPOLL_CTL_MOD, channel->fd_, &ev) != 0) {
+        LOG_C(LOG_ERROR, "epoll_ctl arm fd %d failed: %s", channel->fd_, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+int EventLoop::listenReusePort(const char* ip, unsigned short port, int backlog) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        LOG_C(LOG_ERROR, "socket failed: %s", strerror(errno));
+        return -1;
+    }
+
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0) {
+        LOG_C(LOG_ERROR, "SO_REUSEPORT failed: %s", strerror(errno));
+        ::close(fd);
+        return -1;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = (ip && *ip) ? inet_addr(ip) : htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || ::listen(fd, backlog) != 0) {
+        LOG_C(LOG_ERROR, "listen on %s:%d failed: %s", ip ? ip : "*", port, strerror(errno));
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+EventLoopGroup::EventLoopGroup(Executor executor, size_t count)
+    : next_(0) {
+    for (size_t i = 0; i < (count > 0 ? count : 1); ++i) {
+        loops_.push_back(new EventLoop(executor));
+    }
+}
+
+EventLoopGroup::~EventLoopGroup() {
+    stop();
+    for (size_t i = 0; i < loops_.size(); ++i) {
+        delete loops_[i];
+    }
+    for (size_t i = 0; i < listeners_.size(); ++i) {
+        ::close(listeners_[i]);
+    }
+}
+
+void EventLoopGroup::start() {
+    if (!threads_.empty()) {
+        return;
+    }
+    for (size_t i = 0; i < loops_.size(); ++i) {
+        threads_.push_back(std::thread(&EventLoop::run, loops_[i]));
+    }
+}
+
+void EventLoopGroup::stop() {
+    for (size_t i = 0; i < loops_.size(); ++i) {
+        loops_[i]->stop();
+    }
+    for (size_t i = 0; i < threads_.size(); ++i) {
+        threads_[i].join();
+    }
+    threads_.clear();
+}
+
+EventLoop* EventLoopGroup::next() {
+    return loops_[next_++ % loops_.size()];
+}
+
+bool EventLoopGroup::listen(const char* ip, unsigned short port, const AcceptHandler& handler) {
+    size_t first = listeners_.size();
+    for (size_t i = 0; i < loops_.size(); ++i) {
+        int listener = EventLoop::listenReusePort(ip, port);
+        if (listener < 0) {
+            break;
+        }
+        listeners_.push_back(listener);
+
+        EventLoop* loop = loops_[i];
+        bool added = loop->add(listener, EPOLLIN, [loop, handler](int fd, uint32_t) {
+            for (;;) {
+                int conn = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (conn < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                        LOG_C(LOG_ERROR, "accept failed: %s", strerror(errno));
+                    }
+                    break;
+                }
+                handler(loop, conn);
+            }
+        });
+        if (!added) {
+            break;
+        }
+    }
+    if (listeners_.size() - first == loops_.size()) {
+        return true;
+    }
+
+    // all or nothing, no loop keeps accepting on a port the caller was told failed
+    for (size_t i = first; i < listeners_.size(); ++i) {
+        loops_[i - first]->remove(listeners_[i]);
+        ::close(listeners_[i]);
+    }
+    listeners_.resize(first);
+    return false;
+}
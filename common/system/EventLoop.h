@@ -0,0 +1,175 @@
+#ifndef __CF_EVENT_LOOP_H
+#define __CF_EVENT_LOOP_H
+
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "Executor.h"
+#include "Monitor.h"
+
+/**
+ * Reactor owning socket readiness for a set of file descriptors.
+ *
+ * Descriptors are registered edge-triggered and one-shot. When one becomes
+ * ready its handler is dispatched to the Executor, so it runs on a
+ * std::threadpool or ThreadManager worker instead of the loop thread, and
+ * the descriptor is re-armed once the handler returns. A handler therefore
+ * never runs twice at the same time for one descriptor, and it must read or
+ * write until EAGAIN since the notification is an edge.
+ *
+ * run() is the loop body; host it on any thread, e.g. through a
+ * ThreadFactory like TimerManager. stop() and wakeup() go through an
+ * eventfd and may be called from any thread.
+ */
+class EventLoop : public Runnable {
+public:
+    typedef std::function<void(int fd, uint32_t events)> Handler;
+
+public:
+    explicit EventLoop(Executor executor);
+
+    /**
+     * Stops the loop and waits for the handlers still running on the executor.
+     */
+    ~EventLoop();
+
+public:
+    /**
+     * Registers a descriptor, events is a mask of EPOLLIN, EPOLLOUT, EPOLLRDHUP...
+     * EPOLLET and EPOLLONESHOT are added by the loop. The descriptor should be
+     * non-blocking and stays owned by the caller.
+     */
+    bool add(int fd, uint32_t events, const Handler& handler);
+
+    /**
+     * Changes the events of a registered descriptor. It is armed with them at once,
+     * or once its handler returns if one is running.
+     */
+    bool modify(int fd, uint32_t events);
+
+    /**
+     * Unregisters a descriptor. A handler already dispatched still runs once.
+     */
+    void remove(int fd);
+
+    /**
+     * Waits for readiness and dispatches until stop() is called.
+     */
+    virtual void run();
+
+    void stop();
+
+    /**
+     * Interrupts epoll_wait.
+     */
+    void wakeup();
+
+public:
+    /**
+     * Creates a non-blocking listening TCP socket with SO_REUSEADDR and SO_REUSEPORT
+     * set, so that several loops can each own a socket bound to the same port and
+     * let the kernel spread the connections.
+     * \returns the socket or -1
+     */
+    static int listenReusePort(const char* ip, unsigned short port, int backlog = SOMAXCONN);
+
+private:
+    struct Channel {
+        int fd_;
+        uint32_t events_;
+        bool removed_;
+        bool busy_;             // a dispatch is running, the descriptor is disarmed
+        uint32_t pending_;      // readiness reported while busy_, handled next
+        Handler handler_;
+    };
+
+    /**
+     * A handler handed to the executor. It ends the dispatch once it ran, or when
+     * the executor lets go of it without running it, so that a task the executor
+     * rejected or dropped while stopping does not keep ~EventLoop waiting.
+     */
+    struct Dispatch {
+        Dispatch(EventLoop* loop, const std::shared_ptr<Channel>& channel, uint32_t events)
+            : loop_(loop)
+            , channel_(channel)
+            , events_(events)
+            , done_(false) {}
+        ~Dispatch();
+
+        void run();
+
+        EventLoop* loop_;
+        std::shared_ptr<Channel> channel_;
+        uint32_t events_;
+        bool done_;
+    };
+
+    void dispatch(const std::shared_ptr<Channel>& channel, uint32_t events);
+    /**
+     * Ends a dispatch, arming the descriptor again if its handler ran; one that was
+     * never handled stays disarmed.
+     */
+    void finish(const std::shared_ptr<Channel>& channel, bool rearm);
+    /**
+     * Arms the descriptor with its current events, called with monitor_ held.
+     */
+    bool arm(const std::shared_ptr<Channel>& channel);
+
+private:
+    Executor executor_;
+    int epollFd_;
+    int wakeupFd_;
+    bool stopping_;
+    size_t dispatching_;        // handlers handed to the executor and not yet finished
+    Monitor monitor_;           // guards channels_, stopping_ and dispatching_
+    std::map<int, std::shared_ptr<Channel> > channels_;
+};
+
+/**
+ * Several EventLoops, each running on its own thread.
+ */
+class EventLoopGroup {
+public:
+    /**
+     * Called on an executor worker for every accepted connection, with the loop
+     * owning the listening socket so the connection can be registered there.
+     */
+    typedef std::function<void(EventLoop* loop, int fd)> AcceptHandler;
+
+public:
+    EventLoopGroup(Executor executor, size_t count);
+    ~EventLoopGroup();
+
+public:
+    void start();
+    void stop();
+
+    /**
+     * Gets the loops round robin, to spread connections accepted elsewhere.
+     */
+    EventLoop* next();
+
+    size_t size() const {
+        return loops_.size();
+    }
+
+    /**
+     * Listens on ip:port with one SO_REUSEPORT socket per loop and hands the
+     * accepted non-blocking connections to the handler.
+     * \returns false if any socket could not be set up
+     */
+    bool listen(const char* ip, unsigned short port, const AcceptHandler& handler);
+
+private:
+    std::vector<EventLoop*> loops_;
+    std::vector<std::thread> threads_;
+    std::vector<int> listeners_;
+    std::atomic<size_t> next_;
+};
+
+#endif
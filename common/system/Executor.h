@@ -0,0 +1,67 @@
+#ifndef __CF_EXECUTOR_H
+#define __CF_EXECUTOR_H
+
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include "Thread.h"
+#include "ThreadManager.h"
+#include "../pool/threadpool.h"
+
+/**
+ * Adapts a plain callable to the Runnable interface so it can be handed
+ * to a ThreadManager.
+ */
+class FunctionRunner : public Runnable {
+public:
+    explicit FunctionRunner(const std::function<void()>& func)
+        : func_(func) {}
+
+    virtual void run() {
+        if (func_) {
+            func_();
+        }
+    }
+
+private:
+    std::function<void()> func_;
+};
+
+/**
+ * An executor takes a task and arranges for it to run on some worker thread.
+ * Components that only need "run this somewhere" accept an Executor so they
+ * can sit in front of either std::threadpool or ThreadManager.
+ */
+typedef std::function<void(const std::function<void()>&)> Executor;
+
+class Executors {
+public:
+    /**
+     * Executor committing to a std::threadpool, the pool must outlive it.
+     */
+    static Executor of(std::threadpool& pool) {
+        std::threadpool* ref = &pool;
+        return [ref](const std::function<void()>& task) {
+            ref->commit(task);
+        };
+    }
+
+    /**
+     * Executor adding to a ThreadManager, the manager must outlive it. Like the
+     * threadpool one it throws std::runtime_error when the task is not taken: the
+     * manager is not running, or it stayed full for the timeout.
+     *
+     * \param timeout  milliseconds to wait for room in a manager with
+     *                 pendingTaskCountMax(), negative to fail at once, 0 to wait
+     *                 as long as it takes, which a reactor thread should not do
+     */
+    static Executor of(ThreadManager* manager, int64_t timeout = 0LL) {
+        return [manager, timeout](const std::function<void()>& task) {
+            if (!manager->submit(task, timeout).valid()) {
+                throw std::runtime_error("task rejected by ThreadManager");
+            }
+        };
+    }
+};
+
+#endif
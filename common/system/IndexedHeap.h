@@ -0,0 +1,367 @@
+#ifndef __CF_INDEXED_HEAP_H
+#define __CF_INDEXED_HEAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <utility>
+#include <vector>
+#include "Monitor.h"
+#include "Mutex.h"
+
+/**
+ * Priority queue of (key, value) entries whose keys can be changed, or which
+ * can be taken out, while they are queued: push() returns a handle, and
+ * update(handle, key) and erase(handle) cost O(log n), so reprioritizing an
+ * entry no longer means pushing a duplicate and skipping the stale one later.
+ * As with std::priority_queue, the greatest key under Compare comes out first;
+ * use std::greater for earliest-deadline-first.
+ *
+ * The heap is D-ary and keeps only the keys and slot numbers in its array, so a
+ * sift compares keys that share cache lines and moves small nodes; values stay
+ * put in their slots. Handles carry a generation, so a handle whose entry was
+ * popped or erased is recognised as stale even after its slot is reused.
+ *
+ * Not thread-safe, see IndexedHeap_s.
+ */
+template <class Key, class Value, class Compare = std::less<Key>, size_t D = 4>
+class IndexedHeap {
+public:
+    class Handle {
+    public:
+        Handle()
+            : slot_(NONE)
+            , gen_(0) {}
+
+        bool operator==(const Handle& other) const {
+            return slot_ == other.slot_ && gen_ == other.gen_;
+        }
+
+        bool operator!=(const Handle& other) const {
+            return !(*this == other);
+        }
+
+    private:
+        friend class IndexedHeap;
+
+        Handle(uint32_t slot, uint32_t gen)
+            : slot_(slot)
+            , gen_(gen) {}
+
+        uint32_t slot_;
+        uint32_t gen_;
+    };
+
+    explicit IndexedHeap(const Compare& comp = Compare())
+        : freeSlot_(NONE)
+        , comp_(comp) {}
+
+public:
+    Handle push(const Key& key, const Value& val) {
+        Value copy(val);
+        return push(key, std::move(copy));
+    }
+
+    Handle push(const Key& key, Value&& val) {
+        uint32_t index = allocSlot();
+        Slot& slot = slots_[index];
+        slot.value_ = std::move(val);
+        nodes_.push_back(Node(key, index));
+        siftUp(nodes_.size() - 1);
+        return Handle(index, slot.gen_);
+    }
+
+    /**
+     * Changes the key of a queued entry.
+     * \returns false if the handle is stale
+     */
+    bool update(const Handle& handle, const Key& key) {
+        if (!contains(handle)) {
+            return false;
+        }
+        size_t pos = slots_[handle.slot_].pos_;
+        bool up = comp_(nodes_[pos].key_, key);
+        nodes_[pos].key_ = key;
+        if (up) {
+            siftUp(pos);
+        } else {
+            siftDown(pos);
+        }
+        return true;
+    }
+
+    /**
+     * Takes a queued entry out, dropping its value.
+     * \returns false if the handle is stale
+     */
+    bool erase(const Handle& handle) {
+        if (!contains(handle)) {
+            return false;
+        }
+        removeAt(slots_[handle.slot_].pos_);
+        return true;
+    }
+
+    /**
+     * \returns whether the entry of handle is still queued
+     */
+    bool contains(const Handle& handle) const {
+        return handle.slot_ < slots_.size() && slots_[handle.slot_].gen_ == handle.gen_ &&
+               slots_[handle.slot_].pos_ != NONE;
+    }
+
+    /**
+     * The key and value of a queued entry, the handle must not be stale.
+     */
+    const Key& key(const Handle& handle) const {
+        return nodes_[slots_[handle.slot_].pos_].key_;
+    }
+
+    Value& value(const Handle& handle) {
+        return slots_[handle.slot_].value_;
+    }
+
+    /**
+     * The entry that comes out next, the heap must not be empty.
+     */
+    const Key& topKey() const {
+        return nodes_[0].key_;
+    }
+
+    Value& top() {
+        return slots_[nodes_[0].slot_].value_;
+    }
+
+    Handle topHandle() const {
+        return Handle(nodes_[0].slot_, slots_[nodes_[0].slot_].gen_);
+    }
+
+    /**
+     * Takes the top entry out, the heap must not be empty.
+     * \returns its value
+     */
+    Value pop() {
+        Value val(std::move(top()));
+        removeAt(0);
+        return val;
+    }
+
+    size_t size() const {
+        return nodes_.size();
+    }
+
+    bool empty() const {
+        return nodes_.empty();
+    }
+
+    void clear() {
+        while (!nodes_.empty()) {
+            removeAt(nodes_.size() - 1);
+        }
+    }
+
+    void reserve(size_t n) {
+        nodes_.reserve(n);
+        slots_.reserve(n);
+    }
+
+private:
+    static const uint32_t NONE = UINT32_MAX;
+
+    struct Node {
+        Node(const Key& key, uint32_t slot)
+            : key_(key)
+            , slot_(slot) {}
+
+        Key key_;
+        uint32_t slot_;
+    };
+
+    struct Slot {
+        Slot()
+            : pos_(NONE)
+            , gen_(0)
+            , nextFree_(NONE) {}
+
+        uint32_t pos_;          // index in nodes_, NONE while the slot is free
+        uint32_t gen_;          // bumped every time the slot is freed
+        uint32_t nextFree_;
+        Value value_;
+    };
+
+    uint32_t allocSlot() {
+        uint32_t index = freeSlot_;
+        if (index != NONE) {
+            freeSlot_ = slots_[index].nextFree_;
+        } else {
+            index = (uint32_t)slots_.size();
+            slots_.push_back(Slot());
+        }
+        return index;
+    }
+
+    void freeSlot(uint32_t index) {
+        Slot& slot = slots_[index];
+        slot.value_ = Value();      // let go of what the value holds now
+        slot.pos_ = NONE;
+        ++slot.gen_;
+        slot.nextFree_ = freeSlot_;
+        freeSlot_ = index;
+    }
+
+    /**
+     * Moves the last node into pos and restores the heap around it.
+     */
+    void removeAt(size_t pos) {
+        freeSlot(nodes_[pos].slot_);
+        size_t last = nodes_.size() - 1;
+        if (pos != last) {
+            nodes_[pos] = std::move(nodes_[last]);
+            nodes_.pop_back();
+            if (pos > 0 && comp_(nodes_[(pos - 1) / D].key_, nodes_[pos].key_)) {
+                siftUp(pos);
+            } else {
+                siftDown(pos);
+            }
+        } else {
+            nodes_.pop_back();
+        }
+    }
+
+    /**
+     * Both sifts move a hole instead of swapping, each node is written once.
+     */
+    void siftUp(size_t pos) {
+        Node node(std::move(nodes_[pos]));
+        while (pos > 0) {
+            size_t parent = (pos - 1) / D;
+            if (!comp_(nodes_[parent].key_, node.key_)) {
+                break;
+            }
+            place(pos, std::move(nodes_[parent]));
+            pos = parent;
+        }
+        place(pos, std::move(node));
+    }
+
+    void siftDown(size_t pos) {
+        size_t size = nodes_.size();
+        Node node(std::move(nodes_[pos]));
+        for (;;) {
+            size_t first = pos * D + 1;
+            if (first >= size) {
+                break;
+            }
+            size_t end = first + D < size ? first + D : size;
+            size_t best = first;
+            for (size_t child = first + 1; child < end; ++child) {
+                if (comp_(nodes_[best].key_, nodes_[child].key_)) {
+                    best = child;
+                }
+            }
+            if (!comp_(node.key_, nodes_[best].key_)) {
+                break;
+            }
+            place(pos, std::move(nodes_[best]));
+            pos = best;
+        }
+        place(pos, std::move(node));
+    }
+
+    void place(size_t pos, Node&& node) {
+        slots_[node.slot_].pos_ = (uint32_t)pos;
+        nodes_[pos] = std::move(node);
+    }
+
+private:
+    std::vector<Node> nodes_;       // the heap
+    std::vector<Slot> slots_;       // by handle
+    uint32_t freeSlot_;             // head of the free slots, linked through nextFree_
+    Compare comp_;
+};
+
+/**
+ * IndexedHeap behind a Monitor, with the blocking pop_front() of
+ * Priority_Queue_s: it waits once if the heap is empty, seconds being handed
+ * over as milliseconds, 0 for no limit.
+ */
+template <class Key, class Value, class Compare = std::less<Key>, size_t D = 4>
+class IndexedHeap_s {
+public:
+    typedef typename IndexedHeap<Key, Value, Compare, D>::Handle Handle;
+
+    explicit IndexedHeap_s(const Compare& comp = Compare())
+        : heap_(comp) {}
+
+    IndexedHeap_s(const IndexedHeap_s&) = delete;
+    IndexedHeap_s& operator=(const IndexedHeap_s&) = delete;
+
+public:
+    Handle push(const Key& key, const Value& val) {
+        Guard ug(monitor_.mutex());
+        Handle handle = heap_.push(key, val);
+        monitor_.notify();
+        return handle;
+    }
+
+    Handle push(const Key& key, Value&& val) {
+        Guard ug(monitor_.mutex());
+        Handle handle = heap_.push(key, std::move(val));
+        monitor_.notify();
+        return handle;
+    }
+
+    bool update(const Handle& handle, const Key& key) {
+        Guard ug(monitor_.mutex());
+        return heap_.update(handle, key);
+    }
+
+    bool erase(const Handle& handle) {
+        Guard ug(monitor_.mutex());
+        return heap_.erase(handle);
+    }
+
+    bool contains(const Handle& handle) const {
+        Guard ug(monitor_.mutex());
+        return heap_.contains(handle);
+    }
+
+    /**
+     * \param[out] bstat  false if the heap is still empty, and Value() is returned
+     * \param[out] key    the key of the popped entry, if not NULL
+     */
+    Value pop_front(bool &bstat, double seconds = 0, Key* key = NULL) {
+        Guard ug(monitor_.mutex());
+        if (heap_.empty()) {
+            monitor_.wait((int64_t)seconds);
+        }
+        bstat = !heap_.empty();
+        if (!bstat) {
+            return Value();
+        }
+        if (key) {
+            *key = heap_.topKey();
+        }
+        return heap_.pop();
+    }
+
+    size_t size() const {
+        Guard ug(monitor_.mutex());
+        return heap_.size();
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    void wake_all() {
+        Guard ug(monitor_.mutex());
+        monitor_.notifyAll();
+    }
+
+private:
+    IndexedHeap<Key, Value, Compare, D> heap_;
+    Monitor monitor_;
+};
+
+#endif
@@ -0,0 +1,166 @@
+#ifndef __CF_MPMC_QUEUE_H
+#define __CF_MPMC_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <utility>
+#include "EventCount.h"
+#include "MPMCRing.h"
+
+/**
+ * Bounded blocking queue for any number of producers and consumers, a lock-free
+ * replacement for Queue_s with the same push()/pop_front(bstat, seconds) surface.
+ *
+ * Items live in an MPMCRing, so there is no lock and no allocation per item.
+ * Blocked threads wait on event counts, not on a Monitor: a push or pop costs one
+ * fence and one load on top of the ring while nobody is blocked, and wakes a
+ * single thread otherwise.
+ *
+ * Unlike Queue_s it is bounded: push() blocks while the queue is full, which is
+ * how a slow consumer holds its producers back. As with Queue_s the timeouts,
+ * called seconds, are counted in milliseconds, 0 meaning no limit.
+ */
+template <class T>
+class MPMCQueue {
+public:
+    explicit MPMCQueue(size_t capacity = 1024)
+        : ring_(capacity)
+        , wakeups_(0) {}
+
+    MPMCQueue(const MPMCQueue&) = delete;
+    MPMCQueue& operator=(const MPMCQueue&) = delete;
+
+public:
+    /**
+     * Blocks while the queue is full.
+     */
+    void push(const T& val) {
+        T copy(val);
+        push(std::move(copy), 0);
+    }
+
+    void push(T&& val) {
+        push(std::move(val), 0);
+    }
+
+    /**
+     * Blocks while the queue is full, at most seconds (milliseconds, see above).
+     * \returns false, leaving val alone, on timeout or wake_all()
+     */
+    bool push(const T& val, double seconds) {
+        T copy(val);
+        return push(std::move(copy), seconds);
+    }
+
+    bool push(T&& val, double seconds) {
+        return block(notFull_, [this, &val]() {
+            return tryPush(std::move(val));
+        }, (int64_t)seconds);
+    }
+
+    /**
+     * \returns false, leaving val alone, if the queue is full
+     */
+    bool tryPush(T&& val) {
+        if (!ring_.tryPush(std::move(val))) {
+            return false;
+        }
+        notEmpty_.notify();
+        return true;
+    }
+
+    bool tryPush(const T& val) {
+        T copy(val);
+        return tryPush(std::move(copy));
+    }
+
+    /**
+     * Waits for an item, at most seconds (milliseconds, see above).
+     * \param[out] bstat  false on timeout or wake_all(), and T() is returned
+     */
+    T pop_front(bool &bstat, double seconds = 0) {
+        T val = T();
+        bstat = block(notEmpty_, [this, &val]() {
+            return tryPop(val);
+        }, (int64_t)seconds);
+        return val;
+    }
+
+    bool tryPop(T& val) {
+        if (!ring_.tryPop(val)) {
+            return false;
+        }
+        notFull_.notify();
+        return true;
+    }
+
+    size_t size() const {
+        return ring_.size();
+    }
+
+    bool empty() const {
+        return ring_.empty();
+    }
+
+    size_t capacity() const {
+        return ring_.capacity();
+    }
+
+    /**
+     * Ends the waits of the threads blocked in push() or pop_front(), which return
+     * without an item.
+     */
+    void wake_all() {
+        wakeups_.fetch_add(1);
+        notEmpty_.notifyAll();
+        notFull_.notifyAll();
+    }
+
+private:
+    /**
+     * Runs op until it succeeds, sleeping on event between attempts.
+     * \returns false on timeout or wake_all()
+     */
+    template <class Op>
+    bool block(EventCount& event, Op op, int64_t timeout_ms) {
+        if (op()) {
+            return true;
+        }
+        uint32_t wakeups = wakeups_.load();
+        std::chrono::steady_clock::time_point deadline =
+            std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+        for (;;) {
+            EventCount::Key key = event.prepareWait();
+            if (op()) {
+                event.cancelWait();
+                return true;
+            }
+            if (wakeups_.load() != wakeups) {
+                event.cancelWait();
+                return false;
+            }
+            int64_t left = 0;
+            if (timeout_ms > 0) {
+                left = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           deadline - std::chrono::steady_clock::now()).count();
+                if (left <= 0) {
+                    event.cancelWait();
+                    return false;
+                }
+            }
+            event.wait(key, left);
+        }
+    }
+
+private:
+    MPMCRing<T> ring_;
+    EventCount notEmpty_;               // consumers wait on it
+    char pad0_[CF_CACHE_LINE_SIZE];
+    EventCount notFull_;                // producers wait on it
+    char pad1_[CF_CACHE_LINE_SIZE];
+    std::atomic<uint32_t> wakeups_;     // wake_all() calls
+};
+
+#endif
@@ -0,0 +1,209 @@
+#ifndef __CF_MPMC_RING_H
+#define __CF_MPMC_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <utility>
+#include <vector>
+
+#define CF_CACHE_LINE_SIZE 64
+
+/**
+ * Bounded lock-free multi-producer multi-consumer FIFO (Dmitry Vyukov's
+ * array queue).
+ *
+ * Every cell carries a sequence number telling producers and consumers whose
+ * turn it is, so a push or pop is one CAS on the tail or head position plus
+ * a release store on the cell; there is no lock and no allocation once
+ * constructed. The capacity is rounded up to a power of two.
+ *
+ * tryPush() fails when the ring is full and tryPop() when it is empty, both
+ * without blocking. size() is a snapshot.
+ */
+template <class T>
+class MPMCRing {
+public:
+    explicit MPMCRing(size_t capacity)
+        : cells_(roundUp(capacity))
+        , mask_(cells_.size() - 1)
+        , tail_(0)
+        , head_(0) {
+        for (size_t i = 0; i < cells_.size(); ++i) {
+            cells_[i].seq_.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    MPMCRing(const MPMCRing&) = delete;
+    MPMCRing& operator=(const MPMCRing&) = delete;
+
+public:
+    bool tryPush(const T& value) {
+        return emplace(value);
+    }
+
+    bool tryPush(T&& value) {
+        return emplace(std::move(value));
+    }
+
+    /**
+     * Pushes the first values of an array, as many as there is room for up to max,
+     * with a single CAS on the tail position.
+     * \returns the number of values pushed, 0 if the ring is full
+     */
+    size_t tryPushBatch(const T* values, size_t max) {
+        size_t count;
+        size_t pos = tail_.load(std::memory_order_relaxed);
+        for (;;) {
+            // the free cells from pos on, a stale pos finds none
+            for (count = 0; count < max; ++count) {
+                size_t seq = cells_[(pos + count) & mask_].seq_.load(std::memory_order_acquire);
+                if (seq != pos + count) {
+                    break;
+                }
+            }
+            if (count > 0) {
+                if (tail_.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed)) {
+                    break;
+                }
+                continue;
+            }
+            size_t seq = cells_[pos & mask_].seq_.load(std::memory_order_acquire);
+            if ((intptr_t)seq - (intptr_t)pos < 0) {
+                return 0;
+            }
+            pos = tail_.load(std::memory_order_relaxed);
+        }
+        for (size_t i = 0; i < count; ++i) {
+            Cell* cell = &cells_[(pos + i) & mask_];
+            cell->value_ = values[i];
+            cell->seq_.store(pos + i + 1, std::memory_order_release);
+        }
+        return count;
+    }
+
+    bool tryPop(T& value) {
+        Cell* cell;
+        size_t pos = head_.load(std::memory_order_relaxed);
+        for (;;) {
+            cell = &cells_[pos & mask_];
+            size_t seq = cell->seq_.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (dif == 0) {
+                if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+        value = std::move(cell->value_);
+        cell->value_ = T();
+        cell->seq_.store(pos + mask_ + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Pops up to max values at once and appends them to out, which must not
+     * throw while doing so (reserve() it), for a single CAS on the head position.
+     * \returns the number of values popped, 0 if the ring is empty
+     */
+    template <class Container>
+    size_t tryPopBatch(Container& out, size_t max) {
+        size_t count;
+        size_t pos = head_.load(std::memory_order_relaxed);
+        for (;;) {
+            // the cells from pos on that hold a value, a stale pos finds none
+            for (count = 0; count < max; ++count) {
+                size_t seq = cells_[(pos + count) & mask_].seq_.load(std::memory_order_acquire);
+                if (seq != pos + count + 1) {
+                    break;
+                }
+            }
+            if (count > 0) {
+                if (head_.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed)) {
+                    break;
+                }
+                continue;
+            }
+            size_t seq = cells_[pos & mask_].seq_.load(std::memory_order_acquire);
+            if ((intptr_t)seq - (intptr_t)(pos + 1) < 0) {
+                return 0;
+            }
+            pos = head_.load(std::memory_order_relaxed);
+        }
+        for (size_t i = 0; i < count; ++i) {
+            Cell* cell = &cells_[(pos + i) & mask_];
+            out.push_back(std::move(cell->value_));
+            cell->value_ = T();
+            cell->seq_.store(pos + i + mask_ + 1, std::memory_order_release);
+        }
+        return count;
+    }
+
+    size_t size() const {
+        size_t tail = tail_.load(std::memory_order_acquire);
+        size_t head = head_.load(std::memory_order_acquire);
+        return tail > head ? tail - head : 0;
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    size_t capacity() const {
+        return cells_.size();
+    }
+
+private:
+    template <class U>
+    bool emplace(U&& value) {
+        Cell* cell;
+        size_t pos = tail_.load(std::memory_order_relaxed);
+        for (;;) {
+            cell = &cells_[pos & mask_];
+            size_t seq = cell->seq_.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+            if (dif == 0) {
+                if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = tail_.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value_ = std::forward<U>(value);
+        cell->seq_.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    static size_t roundUp(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        return size;
+    }
+
+    struct Cell {
+        std::atomic<size_t> seq_;
+        T value_;
+
+        Cell()
+            : seq_(0) {}
+    };
+
+    std::vector<Cell> cells_;
+    const size_t mask_;
+    char pad0_[CF_CACHE_LINE_SIZE];
+    std::atomic<size_t> tail_;      // next position to push
+    char pad1_[CF_CACHE_LINE_SIZE];
+    std::atomic<size_t> head_;      // next position to pop
+    char pad2_[CF_CACHE_LINE_SIZE];
+};
+
+#endif
@@ -62,8 +62,8 @@ public:
         }
 
         struct timespec abstime;
-        Util::toTimespec(abstime, Util::currentTime() + timeout_ms);
-        return waitForTime(&abstime);
+        Util::toTimespec(abstime, Util::monotonicTime() + timeout_ms);
+        return waitForMonotonicTime(&abstime);
     }
 
     /**
@@ -71,6 +71,22 @@ public:
      * Returns 0 if condition occurs, THRIFT_ETIMEDOUT on timeout, or an error code.
      */
     int waitForTime(const timespec* abstime) const {
+        // the condition waits on CLOCK_MONOTONIC, move the deadline there
+        int64_t deadline, now;
+        Util::toTicks(deadline, *abstime, NS_PER_S);
+        Util::toTicks(now, wallNow(), NS_PER_S);
+        int64_t target = Util::monotonicTimeTicks(NS_PER_S) + (deadline > now ? deadline - now : 0);
+        struct timespec monotonic;
+        monotonic.tv_sec = target / NS_PER_S;
+        monotonic.tv_nsec = target % NS_PER_S;
+        return waitForMonotonicTime(&monotonic);
+    }
+
+    /**
+     * Waits until an absolute time of CLOCK_MONOTONIC, so that changes of the system
+     * wall clock neither cut the wait short nor prolong it.
+     */
+    int waitForMonotonicTime(const timespec* abstime) const {
         pthread_mutex_t* mutexImpl = static_cast<pthread_mutex_t*>(mutex_->getUnderlyingImpl());
         assert(mutexImpl);
 
@@ -108,8 +124,13 @@ private:
     void init(Mutex* mutex) {
         mutex_ = mutex;
 
-        if (0 == pthread_cond_init(&pthread_cond_, NULL)) {
-            condInitialized_ = true;
+        pthread_condattr_t attr;
+        if (0 == pthread_condattr_init(&attr)) {
+            if (0 == pthread_condattr_setclock(&attr, CLOCK_MONOTONIC)
+                    && 0 == pthread_cond_init(&pthread_cond_, &attr)) {
+                condInitialized_ = true;
+            }
+            pthread_condattr_destroy(&attr);
         }
 
         if (!condInitialized_) {
@@ -125,6 +146,14 @@ private:
         }
     }
 
+    static const int64_t NS_PER_S = 1000000000LL;
+
+    static timespec wallNow() {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        return now;
+    }
+
     Mutex* ownedMutex_;
     Mutex* mutex_;
 
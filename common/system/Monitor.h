@@ -35,14 +35,16 @@ public:
 
     /**
      * Waits a maximum of the specified timeout in milliseconds for the condition
-     * to occur, or waits forever if timeout_ms == 0.
+     * to occur, or waits forever if timeout_ms == 0. The timeout is measured on
+     * CLOCK_MONOTONIC, changes of the system time do not affect it.
      *
      * Returns 0 if condition occurs, THRIFT_ETIMEDOUT on timeout, or an error code.
      */
     int waitForTimeRelative(int64_t timeout_ms) const;
 
     /**
-     * Waits until the absolute time specified using struct timeval.
+     * Waits until the absolute time specified using struct timeval, a wall clock
+     * time that is converted to a timeout when the wait starts.
      * Returns 0 if condition occurs, THRIFT_ETIMEDOUT on timeout, or an error code.
      */
     int waitForTime(const struct timeval* abstime) const;
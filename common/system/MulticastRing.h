@@ -0,0 +1,303 @@
+#ifndef __CF_MULTICAST_RING_H
+#define __CF_MULTICAST_RING_H
+
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+#include "EventCount.h"
+#include "MPMCRing.h"
+
+/**
+ * Disruptor-style ring for fan-out: every reader sees every event, in order,
+ * instead of each getting a copy pushed into its own Queue_s.
+ *
+ * Events live in a preallocated power-of-two array of slots that producers
+ * fill in place and readers read in place, so nothing is allocated or copied
+ * per event. Positions are 64-bit sequences counted from 0.
+ *
+ *  - Producers claim sequences with next(), fill the slots through operator[]
+ *    and make them visible with publish(). With SINGLE, next() is a plain
+ *    increment; with MULTI, any number of threads claim with a fetch-add and
+ *    readers only see contiguously published slots.
+ *  - Each Reader has its own cursor. A reader made with dependencies only sees
+ *    events all of them are done with, so stages can be chained:
+ *        Reader& journal = ring.addReader();
+ *        Reader& replicate = ring.addReader();
+ *        Reader& apply = ring.addReader({&journal, &replicate});
+ *  - Readers handle everything available in one batch, up to a limit, and move
+ *    their cursor once per batch.
+ *  - A producer waits while the slowest reader is a full ring behind.
+ *
+ * Add all the readers before the first event is published. Each reader is used
+ * by one thread at a time.
+ */
+template <class T>
+class MulticastRing {
+public:
+    enum ProducerType {
+        SINGLE,
+        MULTI
+    };
+
+    class Reader {
+    public:
+        /**
+         * Hands the events available now to handler(T& event, int64_t sequence,
+         * bool endOfBatch), at most maxBatch of them, and never blocks.
+         * \returns how many were handled
+         */
+        template <class F>
+        size_t poll(F handler, size_t maxBatch = SIZE_MAX) {
+            int64_t next = sequence_.load(std::memory_order_relaxed) + 1;
+            int64_t last = available(next);
+            if (last < next) {
+                return 0;
+            }
+            if ((uint64_t)(last - next) >= maxBatch) {
+                last = next + (int64_t)maxBatch - 1;
+            }
+            for (int64_t seq = next; seq <= last; ++seq) {
+                handler(ring_->slots_[seq & ring_->mask_], seq, seq == last);
+            }
+            sequence_.store(last, std::memory_order_release);
+            ring_->released_.notifyAll();
+            return (size_t)(last - next + 1);
+        }
+
+        /**
+         * As poll(), but waits once if nothing is available, seconds being handed
+         * over as milliseconds like Queue_s does, 0 for no limit. wake_all() ends
+         * the wait early.
+         */
+        template <class F>
+        size_t read(F handler, double seconds = 0, size_t maxBatch = SIZE_MAX) {
+            size_t count = poll(handler, maxBatch);
+            if (count == 0) {
+                EventCount& event = deps_.empty() ? ring_->published_ : ring_->released_;
+                EventCount::Key key = event.prepareWait();
+                int64_t next = sequence_.load(std::memory_order_relaxed) + 1;
+                if (available(next) >= next) {
+                    event.cancelWait();
+                } else {
+                    int64_t timeout_ms = (int64_t)seconds;
+                    event.wait(key, timeout_ms > 0 ? timeout_ms * 1000000 : 0);
+                }
+                count = poll(handler, maxBatch);
+            }
+            return count;
+        }
+
+        /**
+         * The last sequence this reader is done with, -1 before the first.
+         */
+        int64_t sequence() const {
+            return sequence_.load(std::memory_order_acquire);
+        }
+
+    private:
+        friend class MulticastRing;
+
+        Reader(MulticastRing* ring, const std::vector<Reader*>& deps)
+            : ring_(ring)
+            , deps_(deps)
+            , sequence_(-1) {}
+
+        /**
+         * \returns the last sequence from next on this reader may handle, next - 1
+         *          if there is none
+         */
+        int64_t available(int64_t next) const {
+            if (deps_.empty()) {
+                return ring_->published(next);
+            }
+            int64_t last = INT64_MAX;
+            for (size_t i = 0; i < deps_.size(); ++i) {
+                int64_t seq = deps_[i]->sequence_.load(std::memory_order_acquire);
+                last = seq < last ? seq : last;
+            }
+            return last;
+        }
+
+        MulticastRing* ring_;
+        std::vector<Reader*> deps_;
+        char pad0_[CF_CACHE_LINE_SIZE];
+        std::atomic<int64_t> sequence_;
+        char pad1_[CF_CACHE_LINE_SIZE];
+    };
+
+    explicit MulticastRing(size_t capacity = 1024, ProducerType type = SINGLE)
+        : type_(type)
+        , capacity_(roundUp(capacity))
+        , mask_(capacity_ - 1)
+        , slots_(new T[capacity_])
+        , available_(type == MULTI ? new std::atomic<int64_t>[capacity_] : NULL)
+        , claimed_(-1)
+        , gatingCache_(-1)
+        , cursor_(-1) {
+        if (available_) {
+            for (size_t i = 0; i < capacity_; ++i) {
+                // no sequence of this slot published yet
+                available_[i].store((int64_t)i - (int64_t)capacity_, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    MulticastRing(const MulticastRing&) = delete;
+    MulticastRing& operator=(const MulticastRing&) = delete;
+
+public:
+    /**
+     * \param deps  readers whose events this one only sees once they are done
+     *              with them, none to read straight behind the producers
+     */
+    Reader& addReader(const std::vector<Reader*>& deps = std::vector<Reader*>()) {
+        readers_.push_back(std::unique_ptr<Reader>(new Reader(this, deps)));
+        return *readers_.back();
+    }
+
+    /**
+     * Claims n sequences, waiting while the slowest reader is too far behind.
+     * A batch larger than capacity() would wait for its own slots to be read.
+     * \returns the last of them, the first being that minus n - 1
+     * \throws std::invalid_argument if n is 0 or more than capacity(), nothing
+     *         is claimed then
+     */
+    int64_t next(size_t n = 1) {
+        if (n == 0 || n > capacity_) {
+            throw std::invalid_argument("MulticastRing::next: n must be from 1 to capacity()");
+        }
+        int64_t last;
+        if (type_ == SINGLE) {
+            last = claimed_.load(std::memory_order_relaxed) + (int64_t)n;
+            claimed_.store(last, std::memory_order_relaxed);
+        } else {
+            last = claimed_.fetch_add((int64_t)n, std::memory_order_relaxed) + (int64_t)n;
+        }
+        waitForRoom(last - (int64_t)capacity_);
+        return last;
+    }
+
+    T& operator[](int64_t seq) {
+        return slots_[seq & mask_];
+    }
+
+    /**
+     * Makes the claimed sequences [first, last] visible to the readers.
+     */
+    void publish(int64_t first, int64_t last) {
+        if (type_ == SINGLE) {
+            cursor_.store(last, std::memory_order_release);
+        } else {
+            for (int64_t seq = first; seq <= last; ++seq) {
+                available_[seq & mask_].store(seq, std::memory_order_release);
+            }
+        }
+        published_.notifyAll();
+    }
+
+    void publish(int64_t seq) {
+        publish(seq, seq);
+    }
+
+    /**
+     * Claims a slot, copies val into it and publishes it.
+     */
+    void push(const T& val) {
+        int64_t seq = next();
+        slots_[seq & mask_] = val;
+        publish(seq);
+    }
+
+    size_t capacity() const {
+        return capacity_;
+    }
+
+    /**
+     * Ends the waits of the readers blocked in read().
+     */
+    void wake_all() {
+        published_.notifyAll();
+        released_.notifyAll();
+    }
+
+private:
+    static size_t roundUp(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        return size;
+    }
+
+    /**
+     * \returns the last sequence from next on published without gaps, next - 1
+     *          if there is none
+     */
+    int64_t published(int64_t next) const {
+        if (type_ == SINGLE) {
+            return cursor_.load(std::memory_order_acquire);
+        }
+        int64_t last = claimed_.load(std::memory_order_acquire);
+        int64_t seq = next;
+        while (seq <= last && available_[seq & mask_].load(std::memory_order_acquire) == seq) {
+            ++seq;
+        }
+        return seq - 1;
+    }
+
+    int64_t slowestReader() const {
+        int64_t slowest = INT64_MAX;
+        for (size_t i = 0; i < readers_.size(); ++i) {
+            int64_t seq = readers_[i]->sequence_.load(std::memory_order_acquire);
+            slowest = seq < slowest ? seq : slowest;
+        }
+        return slowest;
+    }
+
+    /**
+     * Waits until every reader is done with wrap, the sequence whose slot is about
+     * to be reused.
+     */
+    void waitForRoom(int64_t wrap) {
+        if (wrap <= gatingCache_.load(std::memory_order_relaxed)) {
+            return;
+        }
+        for (;;) {
+            int64_t slowest = slowestReader();
+            if (wrap <= slowest) {
+                gatingCache_.store(slowest, std::memory_order_relaxed);
+                return;
+            }
+            EventCount::Key key = released_.prepareWait();
+            if (wrap <= slowestReader()) {
+                released_.cancelWait();
+                continue;
+            }
+            released_.wait(key);
+        }
+    }
+
+private:
+    const ProducerType type_;
+    const size_t capacity_;
+    const size_t mask_;
+    std::unique_ptr<T[]> slots_;
+    std::unique_ptr<std::atomic<int64_t>[]> available_;    // MULTI: last sequence published in each slot
+    std::vector<std::unique_ptr<Reader> > readers_;
+    char pad0_[CF_CACHE_LINE_SIZE];
+    std::atomic<int64_t> claimed_;      // last sequence claimed
+    std::atomic<int64_t> gatingCache_;  // slowest reader as last seen by a producer
+    char pad1_[CF_CACHE_LINE_SIZE];
+    std::atomic<int64_t> cursor_;       // SINGLE: last sequence published
+    char pad2_[CF_CACHE_LINE_SIZE];
+    EventCount published_;              // readers without dependencies wait on it
+    char pad3_[CF_CACHE_LINE_SIZE];
+    EventCount released_;               // dependent readers and producers wait on it
+};
+
+#endif
@@ -21,7 +21,7 @@ public:
         CHECK_RETURN_VALUE(pthread_mutex_lock(&pthread_mutex_));
     };
     bool trylock() {
-        return pthread_mutex_trylock(&pthread_mutex_);
+        return pthread_mutex_trylock(&pthread_mutex_) == 0;
     }
     bool timedlock(int64_t milliseconds) {
         struct timespec ts;
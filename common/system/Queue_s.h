@@ -9,7 +9,8 @@ Queue_s.h
 *
 * 说明 :
 *1、Queue_s：
-*         基于模板stl中queue实现线程安全
+*         基于模板stl中queue实现线程安全, 默认底层容器为分块环形缓冲 ChunkedRing,
+*         不按元素分配内存; 支持移动语义与批量压入/取出
 * 2、Priority_Queue_s：
 *         基于模板stl中priority_queue实现线程安全
 * 3、用法跟普通模板用法一致
@@ -26,17 +27,29 @@ Queue_s.h
 #include <list>
 #include <functional>   // std::less
 #include <algorithm>    // std::sort, std::includes
+#include <utility>
+#include "ChunkedRing.h"
 #include "Monitor.h"
 #include "Mutex.h"
 
-template <class T, class Sequence = std::list<T> >
+template <class T, class Sequence = ChunkedRing<T> >
 class Queue_s : public std::queue < T, Sequence > {
 public:
     explicit Queue_s();
     ~Queue_s();
 public:
     void push(const T& val);
+    void push(T&& val);
+    template <class... Args>
+    void emplace(Args&&... args);
+    // 一次加锁压入 [first, last)
+    template <class InputIt>
+    void push_range(InputIt first, InputIt last);
+    // 取出的元素是移出的, 支持 unique_ptr 等只能移动的类型
     T pop_front(bool &bstat, double seconds = 0);
+    // 一次加锁最多取出 max_n 个元素写到 out, 队列为空时同 pop_front 等待一次; 返回取出的个数
+    template <class OutputIt>
+    size_t drain(OutputIt out, size_t max_n, double seconds = 0);
     size_t size() const;
     void swap(Queue_s& t);
     void wake_all();
@@ -81,6 +94,35 @@ void Queue_s<T, Sequence>::push(const T& val) {
     pcond_->notify();
 }
 
+template <class T, class Sequence>
+void Queue_s<T, Sequence>::push(T&& val) {
+    Guard ug(pcond_->mutex());
+    std::queue<T, Sequence>::push(std::move(val));
+    pcond_->notify();
+}
+
+template <class T, class Sequence>
+template <class... Args>
+void Queue_s<T, Sequence>::emplace(Args&&... args) {
+    Guard ug(pcond_->mutex());
+    std::queue<T, Sequence>::emplace(std::forward<Args>(args)...);
+    pcond_->notify();
+}
+
+template <class T, class Sequence>
+template <class InputIt>
+void Queue_s<T, Sequence>::push_range(InputIt first, InputIt last) {
+    Guard ug(pcond_->mutex());
+    size_t count = 0;
+    for (; first != last; ++first, ++count)
+        std::queue<T, Sequence>::push(*first);
+
+    if (count > 1)
+        pcond_->notifyAll();
+    else if (count == 1)
+        pcond_->notify();
+}
+
 template <class T, class Sequence>
 void Queue_s<T, Sequence>::pop() {
     Guard ug(pcond_->mutex());
@@ -94,7 +136,7 @@ T Queue_s<T, Sequence>::pop_front(bool &bstat, double seconds) {
         pcond_->wait(seconds);
 
     if (!std::queue<T, Sequence>::empty()) {
-        T tmp(std::queue<T, Sequence>::front());
+        T tmp(std::move(std::queue<T, Sequence>::front()));
         std::queue<T, Sequence>::pop();
         bstat = true;
         return tmp;
@@ -103,6 +145,22 @@ T Queue_s<T, Sequence>::pop_front(bool &bstat, double seconds) {
     return T();
 }
 
+template <class T, class Sequence>
+template <class OutputIt>
+size_t Queue_s<T, Sequence>::drain(OutputIt out, size_t max_n, double seconds) {
+    Guard ug(pcond_->mutex());
+    if (std::queue<T, Sequence>::empty())
+        pcond_->wait(seconds);
+
+    size_t count = 0;
+    for (; count < max_n && !std::queue<T, Sequence>::empty(); ++count) {
+        *out = std::move(std::queue<T, Sequence>::front());
+        ++out;
+        std::queue<T, Sequence>::pop();
+    }
+    return count;
+}
+
 template <class T, class Sequence>
 size_t Queue_s<T, Sequence>::size() const {
     Guard ug(pcond_->mutex());
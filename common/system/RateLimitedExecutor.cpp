@@ -0,0 +1,133 @@
+#include "RateLimitedExecutor.h"
+#include <vector>
+#include "../logcpp/log.h"
+#include "../utils/utime.h"
+#include "TimerManager.h"
+
+RateLimitedExecutor::RateLimitedExecutor(Executor executor, TimerManager* timerManager, unsigned tickMs)
+    : state_(new State())
+    , tick_(NULL) {
+    state_->executor_ = executor;
+    TimerManager* manager = timerManager ? timerManager : &TimerManager::getInstance();
+    tick_ = manager->grabTimer();
+    if (!tick_) {
+        LOG_CXX(LOG_ERROR) << "no timer available, deferred tasks are never released";
+        return;
+    }
+    std::weak_ptr<State> ref(state_);
+    tick_->startMs([ref]() {
+        RateLimitedExecutor::release(ref);
+    }, tickMs > 0 ? tickMs : 1, Timer::TIMER_PERSIST);
+}
+
+RateLimitedExecutor::~RateLimitedExecutor() {
+    if (tick_) {
+        tick_->stop();
+    }
+    Guard g(state_->mutex_);
+    for (std::map<uint32_t, Bucket>::iterator it = state_->buckets_.begin(); it != state_->buckets_.end(); ++it) {
+        if (!it->second.deferred_.empty()) {
+            LOG_C(LOG_WARNING, "class %u drops %lu deferred tasks", it->first, it->second.deferred_.size());
+        }
+    }
+    state_->buckets_.clear();
+}
+
+void RateLimitedExecutor::setLimit(uint32_t classId, double ratePerSec, double burst) {
+    std::vector<Task> ready;
+    {
+        Guard g(state_->mutex_);
+        bool created = state_->buckets_.find(classId) == state_->buckets_.end();
+        Bucket& bucket = state_->buckets_[classId];
+        refill(bucket, Util::monotonicTimeUsec());
+        bucket.rate_ = ratePerSec > 0 ? ratePerSec : 0;
+        bucket.burst_ = burst > 1 ? burst : 1;
+        if (created) {
+            // a new class may start with a full burst
+            bucket.tokens_ = bucket.burst_;
+        } else if (bucket.tokens_ > bucket.burst_) {
+            bucket.tokens_ = bucket.burst_;
+        }
+        if (bucket.rate_ == 0) {
+            // unlimited from now on, flush what was held back
+            ready.assign(bucket.deferred_.begin(), bucket.deferred_.end());
+            bucket.deferred_.clear();
+        }
+    }
+
+    for (size_t i = 0; i < ready.size(); ++i) {
+        state_->executor_(ready[i]);
+    }
+}
+
+void RateLimitedExecutor::execute(uint32_t classId, const Task& task) {
+    {
+        Guard g(state_->mutex_);
+        std::map<uint32_t, Bucket>::iterator it = state_->buckets_.find(classId);
+        if (it != state_->buckets_.end() && it->second.rate_ > 0) {
+            Bucket& bucket = it->second;
+            refill(bucket, Util::monotonicTimeUsec());
+
+            // keep FIFO order within the class: nobody overtakes deferred tasks
+            if (!bucket.deferred_.empty() || bucket.tokens_ < 1) {
+                bucket.deferred_.push_back(task);
+                return;
+            }
+            bucket.tokens_ -= 1;
+        }
+    }
+
+    state_->executor_(task);
+}
+
+size_t RateLimitedExecutor::deferredCount(uint32_t classId) {
+    Guard g(state_->mutex_);
+    std::map<uint32_t, Bucket>::iterator it = state_->buckets_.find(classId);
+    return it != state_->buckets_.end() ? it->second.deferred_.size() : 0;
+}
+
+void RateLimitedExecutor::refill(Bucket& bucket, int64_t now) {
+    if (bucket.refillTime_ != 0 && now > bucket.refillTime_) {
+        bucket.tokens_ += bucket.rate_ * (now - bucket.refillTime_) / 1000000.0;
+        if (bucket.tokens_ > bucket.burst_) {
+            bucket.tokens_ = bucket.burst_;
+        }
+    }
+    bucket.refillTime_ = now;
+}
+
+void RateLimitedExecutor::release(const std::weak_ptr<State>& ref) {
+    std::shared_ptr<State> state = ref.lock();
+    if (!state) {
+        return;
+    }
+
+    std::vector<Task> ready;
+    {
+        Guard g(state->mutex_);
+        int64_t now = Util::monotonicTimeUsec();
+        for (std::map<uint32_t, Bucket>::iterator it = state->buckets_.begin(); it != state->buckets_.end(); ++it) {
+            Bucket& bucket = it->second;
+            if (bucket.deferred_.empty()) {
+                continue;
+            }
+            refill(bucket, now);
+            while (!bucket.deferred_.empty() && bucket.tokens_ >= 1) {
+                ready.push_back(bucket.deferred_.front());
+                bucket.deferred_.pop_front();
+                bucket.tokens_ -= 1;
+            }
+        }
+    }
+
+    // the tick runs in the TimerManager's event loop, nothing may escape it
+    for (size_t i = 0; i < ready.size(); ++i) {
+        try {
+            state->executor_(ready[i]);
+        } catch (const std::exception& e) {
+            LOG_CXX(LOG_ERROR) << "deferred task dropped: " << e.what();
+        } catch (...) {
+            LOG_CXX(LOG_ERROR) << "deferred task dropped";
+        }
+    }
+}
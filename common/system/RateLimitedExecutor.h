@@ -0,0 +1,98 @@
+#ifndef __CF_RATE_LIMITED_EXECUTOR_H
+#define __CF_RATE_LIMITED_EXECUTOR_H
+
+#include <stdint.h>
+#include <deque>
+#include <map>
+#include <memory>
+#include "Executor.h"
+#include "Mutex.h"
+
+class Timer;
+class TimerManager;
+
+/**
+ * Token-bucket rate limiter in front of an Executor.
+ *
+ * Every task is submitted under a class id. A class configured with
+ * setLimit() may start at most `rate` tasks per second on average and at
+ * most `burst` tasks back to back. Tokens are refilled lazily from the
+ * monotonic clock whenever the bucket is touched, so there is no refill
+ * thread. Tasks over the limit are queued per class in FIFO order and
+ * released by a persistent tick of the TimerManager, which hands out the
+ * tokens refilled since the last one; they never occupy a pool thread while
+ * waiting. The tick is armed once, at construction, so submitters never touch
+ * the TimerManager's event base.
+ *
+ * Classes without a limit pass straight through to the executor, and an
+ * executor that rejects a task makes execute() throw as it does.
+ */
+class RateLimitedExecutor {
+public:
+    typedef std::function<void()> Task;
+
+public:
+    /**
+     * The TimerManager must be running (its run() hosted by some thread) for
+     * deferred tasks to be released.
+     * \param tickMs  period of the release tick, deferred tasks start up to that
+     *                much later than their token is due
+     */
+    explicit RateLimitedExecutor(Executor executor, TimerManager* timerManager = NULL, unsigned tickMs = 5);
+    ~RateLimitedExecutor();
+
+public:
+    /**
+     * Sets the limit of a class.
+     * \param ratePerSec  sustained tasks per second, 0 removes the limit
+     * \param burst       bucket capacity, values below 1 are raised to 1
+     */
+    void setLimit(uint32_t classId, double ratePerSec, double burst);
+
+    /**
+     * Runs the task on the executor now if the class has a token,
+     * otherwise defers it until one is available.
+     */
+    void execute(uint32_t classId, const Task& task);
+
+    /**
+     * Gets the number of tasks of the class waiting for a token
+     */
+    size_t deferredCount(uint32_t classId);
+
+private:
+    struct Bucket {
+        double rate_;
+        double burst_;
+        double tokens_;
+        int64_t refillTime_;    // microseconds, monotonic
+        std::deque<Task> deferred_;
+
+        Bucket()
+            : rate_(0)
+            , burst_(1)
+            , tokens_(1)
+            , refillTime_(0) {}
+    };
+
+    /**
+     * State shared with the tick, which may fire after the executor is gone.
+     */
+    struct State {
+        Executor executor_;
+        Mutex mutex_;
+        std::map<uint32_t, Bucket> buckets_;
+    };
+
+    static void refill(Bucket& bucket, int64_t now);
+    /**
+     * Runs on the TimerManager thread, every tickMs.
+     */
+    static void release(const std::weak_ptr<State>& ref);
+
+private:
+    std::shared_ptr<State> state_;
+    Timer* tick_;
+};
+
+#endif
@@ -0,0 +1,345 @@
+#ifndef __CF_SEGMENTED_QUEUE_H
+#define __CF_SEGMENTED_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "Epoch.h"
+#include "EventCount.h"
+#include "MPMCRing.h"
+#include "Mutex.h"
+
+/**
+ * Unbounded lock-free queue for any number of producers and consumers, with
+ * the push()/pop_front(bstat, seconds) surface of Queue_s, for traffic whose
+ * bursts no bounded ring can be sized for.
+ *
+ * Items live in a linked list of segments of SEGMENT cells. A push or pop is a
+ * fetch-add on the index of the tail or head segment, and a single state change
+ * of the cell it lands on. A consumer that overtakes a slow producer on a cell
+ * marks it taken, and that producer moves on to the next cell.
+ *
+ * Drained segments are unlinked and reclaimed through Epoch, then kept in a pool
+ * of up to poolMax for reuse, so a queue whose length keeps swinging within
+ * poolMax segments stops allocating once warmed up.
+ *
+ * pop_front() waits once if the queue is empty, seconds being handed over as
+ * milliseconds like Queue_s does, 0 for no limit. There is no swap().
+ */
+template <class T, size_t SEGMENT = 1024>
+class SegmentedQueue {
+public:
+    explicit SegmentedQueue(size_t poolMax = 16)
+        : poolMax_(poolMax) {
+        Segment* segment = new Segment();
+        head_.store(segment, std::memory_order_relaxed);
+        tail_.store(segment, std::memory_order_relaxed);
+    }
+
+    SegmentedQueue(const SegmentedQueue&) = delete;
+    SegmentedQueue& operator=(const SegmentedQueue&) = delete;
+
+    ~SegmentedQueue() {
+        T val;
+        while (tryPop(val)) {
+        }
+        Segment* segment = head_.load(std::memory_order_relaxed);
+        while (segment) {
+            Segment* next = segment->next_.load(std::memory_order_relaxed);
+            delete segment;
+            segment = next;
+        }
+        for (size_t i = 0; i < pool_.size(); ++i) {
+            delete pool_[i];
+        }
+        for (size_t i = 0; i < retired_.size(); ++i) {
+            delete retired_[i].first;
+        }
+    }
+
+public:
+    void push(const T& val) {
+        T copy(val);
+        push(std::move(copy));
+    }
+
+    void push(T&& val) {
+        {
+            Epoch::Guard guard;
+            for (;;) {
+                Segment* segment = tail_.load(std::memory_order_acquire);
+                size_t index = segment->enqueue_.fetch_add(1, std::memory_order_relaxed);
+                if (index < SEGMENT) {
+                    if (segment->cells_[index].put(std::move(val))) {
+                        break;
+                    }
+                    continue;       // taken by a consumer, val is still there
+                }
+                if (append(segment, val)) {
+                    break;
+                }
+            }
+        }
+        notEmpty_.notify();
+    }
+
+    /**
+     * Waits once if the queue is empty, wake_all() ends the wait early.
+     * \param[out] bstat  false if there is still no item, and T() is returned
+     */
+    T pop_front(bool &bstat, double seconds = 0) {
+        T val = T();
+        bstat = tryPop(val);
+        if (!bstat) {
+            EventCount::Key key = notEmpty_.prepareWait();
+            bstat = tryPop(val);
+            if (bstat) {
+                notEmpty_.cancelWait();
+            } else {
+                int64_t timeout_ms = (int64_t)seconds;
+                notEmpty_.wait(key, timeout_ms > 0 ? timeout_ms * 1000000 : 0);
+                bstat = tryPop(val);
+            }
+        }
+        return val;
+    }
+
+    /**
+     * Never blocks.
+     */
+    bool tryPop(T& val) {
+        Segment* retire = NULL;
+        bool found = false;
+        {
+            Epoch::Guard guard;
+            for (;;) {
+                Segment* segment = head_.load(std::memory_order_acquire);
+                size_t index = segment->dequeue_.load(std::memory_order_relaxed);
+                if (index < SEGMENT) {
+                    if (index >= segment->enqueue_.load(std::memory_order_acquire)) {
+                        break;      // empty
+                    }
+                    index = segment->dequeue_.fetch_add(1, std::memory_order_relaxed);
+                    if (index < SEGMENT) {
+                        if (segment->cells_[index].take(val)) {
+                            found = true;
+                            break;
+                        }
+                        continue;
+                    }
+                }
+                // drained, move on to the next segment if there is one
+                Segment* next = segment->next_.load(std::memory_order_acquire);
+                if (!next) {
+                    break;
+                }
+                // the tail never points back at a retired segment
+                Segment* tail = segment;
+                tail_.compare_exchange_strong(tail, next, std::memory_order_acq_rel);
+                if (head_.compare_exchange_strong(segment, next, std::memory_order_acq_rel)) {
+                    retire = segment;
+                }
+            }
+        }
+        if (retire) {
+            recycle(retire);
+        }
+        return found;
+    }
+
+    /**
+     * A snapshot, segments are not counted at the same moment.
+     */
+    size_t size() const {
+        Epoch::Guard guard;
+        size_t total = 0;
+        for (Segment* segment = head_.load(std::memory_order_acquire); segment;
+             segment = segment->next_.load(std::memory_order_acquire)) {
+            size_t enqueue = segment->enqueue_.load(std::memory_order_relaxed);
+            size_t dequeue = segment->dequeue_.load(std::memory_order_relaxed);
+            enqueue = enqueue < SEGMENT ? enqueue : SEGMENT;
+            dequeue = dequeue < SEGMENT ? dequeue : SEGMENT;
+            total += enqueue > dequeue ? enqueue - dequeue : 0;
+        }
+        return total;
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    /**
+     * Wakes the threads blocked in pop_front().
+     */
+    void wake_all() {
+        notEmpty_.notifyAll();
+    }
+
+private:
+    enum {
+        EMPTY,
+        FULL,
+        TAKEN       // given up on by a consumer, the producer moves on
+    };
+
+    // loads a consumer waits for a producer that claimed its cell
+    static const int SPIN = 64;
+
+    struct Cell {
+        /**
+         * \returns false, leaving val alone, if a consumer gave up on the cell
+         */
+        bool put(T&& val) {
+            new (&value_) T(std::move(val));
+            int state = EMPTY;
+            if (state_.compare_exchange_strong(state, FULL, std::memory_order_release,
+                                               std::memory_order_relaxed)) {
+                return true;
+            }
+            T* item = reinterpret_cast<T*>(&value_);
+            val = std::move(*item);
+            item->~T();
+            return false;
+        }
+
+        bool take(T& val) {
+            int state = EMPTY;
+            for (int i = 0; i < SPIN; ++i) {
+                state = state_.load(std::memory_order_acquire);
+                if (state != EMPTY) {
+                    break;
+                }
+            }
+            if (state == EMPTY &&
+                state_.compare_exchange_strong(state, TAKEN, std::memory_order_acquire)) {
+                return false;
+            }
+            T* item = reinterpret_cast<T*>(&value_);
+            val = std::move(*item);
+            item->~T();
+            return true;
+        }
+
+        std::atomic<int> state_;
+        typename std::aligned_storage<sizeof(T), std::alignment_of<T>::value>::type value_;
+    };
+
+    struct Segment {
+        Segment() {
+            reset();
+        }
+
+        void reset() {
+            enqueue_.store(0, std::memory_order_relaxed);
+            dequeue_.store(0, std::memory_order_relaxed);
+            next_.store(NULL, std::memory_order_relaxed);
+            for (size_t i = 0; i < SEGMENT; ++i) {
+                cells_[i].state_.store(EMPTY, std::memory_order_relaxed);
+            }
+        }
+
+        std::atomic<size_t> enqueue_;   // next cell to push to, runs past SEGMENT when full
+        char pad0_[CF_CACHE_LINE_SIZE];
+        std::atomic<size_t> dequeue_;   // next cell to pop from, runs past SEGMENT when drained
+        char pad1_[CF_CACHE_LINE_SIZE];
+        std::atomic<Segment*> next_;
+        Cell cells_[SEGMENT];
+    };
+
+    /**
+     * The tail segment is full: links a new one holding val after it, unless
+     * another producer did first, and moves the tail on.
+     * \returns whether val went into the new segment
+     */
+    bool append(Segment* segment, T& val) {
+        Segment* next = segment->next_.load(std::memory_order_acquire);
+        bool pushed = false;
+        if (!next) {
+            Segment* fresh = allocate();
+            fresh->enqueue_.store(1, std::memory_order_relaxed);
+            new (&fresh->cells_[0].value_) T(std::move(val));
+            fresh->cells_[0].state_.store(FULL, std::memory_order_relaxed);
+            if (segment->next_.compare_exchange_strong(next, fresh, std::memory_order_acq_rel)) {
+                next = fresh;
+                pushed = true;
+            } else {
+                // never published, no one else saw it
+                T* item = reinterpret_cast<T*>(&fresh->cells_[0].value_);
+                val = std::move(*item);
+                item->~T();
+                fresh->reset();
+                Guard ug(poolMutex_);
+                pool_.push_back(fresh);
+            }
+        }
+        tail_.compare_exchange_strong(segment, next, std::memory_order_acq_rel);
+        return pushed;
+    }
+
+    Segment* allocate() {
+        {
+            Guard ug(poolMutex_);
+            if (pool_.empty()) {
+                collect();
+            }
+            if (!pool_.empty()) {
+                Segment* segment = pool_.back();
+                pool_.pop_back();
+                return segment;
+            }
+        }
+        return new Segment();
+    }
+
+    /**
+     * Parks an unlinked segment until no thread can still be on it.
+     */
+    void recycle(Segment* segment) {
+        uint64_t epoch = Epoch::current();
+        Guard ug(poolMutex_);
+        retired_.push_back(std::make_pair(segment, epoch));
+        collect();
+    }
+
+    /**
+     * Moves the retired segments that are safe to touch again to the pool, with
+     * poolMutex_ held.
+     */
+    void collect() {
+        if (retired_.empty()) {
+            return;
+        }
+        uint64_t epoch = Epoch::tryAdvance();
+        size_t kept = 0;
+        for (size_t i = 0; i < retired_.size(); ++i) {
+            Segment* segment = retired_[i].first;
+            if (retired_[i].second + 2 > epoch) {
+                retired_[kept++] = retired_[i];
+            } else if (pool_.size() < poolMax_) {
+                segment->reset();
+                pool_.push_back(segment);
+            } else {
+                delete segment;
+            }
+        }
+        retired_.resize(kept);
+    }
+
+private:
+    std::atomic<Segment*> head_;
+    char pad0_[CF_CACHE_LINE_SIZE];
+    std::atomic<Segment*> tail_;
+    char pad1_[CF_CACHE_LINE_SIZE];
+    EventCount notEmpty_;                                   // pop_front() waits on it
+    char pad2_[CF_CACHE_LINE_SIZE];
+    const size_t poolMax_;
+    Mutex poolMutex_;
+    std::vector<Segment*> pool_;                            // reset, ready to be linked
+    std::vector<std::pair<Segment*, uint64_t> > retired_;   // unlinked, with their epoch
+};
+
+#endif
@@ -0,0 +1,202 @@
+#ifndef __CF_SPSC_QUEUE_H
+#define __CF_SPSC_QUEUE_H
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <memory>
+#include <utility>
+#include "MPMCRing.h"
+
+/**
+ * Bounded lock-free queue for exactly one producer thread and one consumer
+ * thread, with the push()/pop_front() surface of Queue_s.
+ *
+ * Items live in a power-of-two ring, so pushing allocates nothing. Each side
+ * owns its index and keeps a cached copy of the other side's on its own cache
+ * line, and only reloads the shared one when the cached copy says the ring is
+ * full (producer) or empty (consumer).
+ *
+ * The consumer blocks only when the ring is empty, on a futex waiter flag: the
+ * producer pays for a system call only when the consumer is actually asleep.
+ * A producer finding the ring full yields until there is room, so size the ring
+ * for the bursts of the pipeline.
+ *
+ * Unlike Queue_s it has no swap(): it cannot be done without stopping both sides.
+ */
+template <class T>
+class SpscQueue {
+public:
+    explicit SpscQueue(size_t capacity = 1024)
+        : capacity_(roundUp(capacity))
+        , mask_(capacity_ - 1)
+        , items_(new T[capacity_])
+        , tail_(0)
+        , headCache_(0)
+        , head_(0)
+        , tailCache_(0)
+        , waiting_(0) {}
+
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+public:
+    /**
+     * Producer side, yields while the ring is full.
+     */
+    void push(const T& val) {
+        T copy(val);
+        push(std::move(copy));
+    }
+
+    void push(T&& val) {
+        while (!tryPush(std::move(val))) {
+            sched_yield();
+        }
+    }
+
+    /**
+     * Producer side.
+     * \returns false, leaving val alone, if the ring is full
+     */
+    bool tryPush(T&& val) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - headCache_ == capacity_) {
+            headCache_ = head_.load(std::memory_order_acquire);
+            if (tail - headCache_ == capacity_) {
+                return false;
+            }
+        }
+        items_[tail & mask_] = std::move(val);
+        tail_.store(tail + 1, std::memory_order_release);
+
+        // pairs with the fence of the consumer going to sleep: either it sees the
+        // new tail or this sees its flag
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiting_.load(std::memory_order_relaxed) != 0) {
+            wake();
+        }
+        return true;
+    }
+
+    bool tryPush(const T& val) {
+        T copy(val);
+        return tryPush(std::move(copy));
+    }
+
+    /**
+     * Consumer side, as Queue_s::pop_front(): waits once if the ring is empty,
+     * seconds being handed over as milliseconds like Queue_s does, 0 for no limit.
+     * wake_all() ends the wait early.
+     */
+    T pop_front(bool &bstat, double seconds = 0) {
+        T val;
+        bstat = tryPop(val);
+        if (!bstat) {
+            sleep((int64_t)seconds);
+            bstat = tryPop(val);
+        }
+        return val;
+    }
+
+    /**
+     * Consumer side, never blocks.
+     */
+    bool tryPop(T& val) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tailCache_) {
+            tailCache_ = tail_.load(std::memory_order_acquire);
+            if (head == tailCache_) {
+                return false;
+            }
+        }
+        val = std::move(items_[head & mask_]);
+        items_[head & mask_] = T();     // let go of what the item holds now
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * A snapshot, exact only on the producer or the consumer thread.
+     */
+    size_t size() const {
+        size_t head = head_.load(std::memory_order_acquire);
+        size_t tail = tail_.load(std::memory_order_acquire);
+        return tail > head ? tail - head : 0;
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    size_t capacity() const {
+        return capacity_;
+    }
+
+    /**
+     * Wakes the consumer if it is blocked in pop_front().
+     */
+    void wake_all() {
+        waiting_.store(0, std::memory_order_relaxed);
+        futex(FUTEX_WAKE_PRIVATE, INT_MAX, NULL);
+    }
+
+private:
+    static size_t roundUp(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        return size;
+    }
+
+    void sleep(int64_t timeout_ms) {
+        waiting_.store(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (tail_.load(std::memory_order_relaxed) == head_.load(std::memory_order_relaxed)) {
+            if (timeout_ms > 0) {
+                struct timespec ts;
+                ts.tv_sec = timeout_ms / 1000;
+                ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+                futex(FUTEX_WAIT_PRIVATE, 1, &ts);
+            } else {
+                futex(FUTEX_WAIT_PRIVATE, 1, NULL);
+            }
+        }
+        waiting_.store(0, std::memory_order_relaxed);
+    }
+
+    void wake() {
+        if (waiting_.exchange(0, std::memory_order_relaxed) != 0) {
+            futex(FUTEX_WAKE_PRIVATE, 1, NULL);
+        }
+    }
+
+    void futex(int op, int value, const struct timespec* timeout) {
+        syscall(SYS_futex, reinterpret_cast<int*>(&waiting_), op, value, timeout, NULL, 0);
+    }
+
+private:
+    const size_t capacity_;
+    const size_t mask_;
+    std::unique_ptr<T[]> items_;
+    char pad0_[CF_CACHE_LINE_SIZE];
+    // producer
+    std::atomic<size_t> tail_;      // next position to push
+    size_t headCache_;              // head_ as last seen
+    char pad1_[CF_CACHE_LINE_SIZE];
+    // consumer
+    std::atomic<size_t> head_;      // next position to pop
+    size_t tailCache_;              // tail_ as last seen
+    char pad2_[CF_CACHE_LINE_SIZE];
+    std::atomic<int> waiting_;      // futex word, 1 while the consumer sleeps or is about to
+    char pad3_[CF_CACHE_LINE_SIZE];
+};
+
+#endif
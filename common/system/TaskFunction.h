@@ -0,0 +1,153 @@
+#ifndef __CF_TASK_FUNCTION_H
+#define __CF_TASK_FUNCTION_H
+
+#include <stddef.h>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/**
+ * A void() callable, type-erased like std::function but move-only, so that
+ * move-only callables (lambdas owning a unique_ptr, packaged_task...) can be
+ * handed to a ThreadManager without a Runnable subclass.
+ *
+ * Callables of up to INLINE_SIZE bytes that can be moved without throwing are
+ * stored in place and never allocate; larger ones are moved to the heap.
+ */
+class TaskFunction {
+public:
+    static const size_t INLINE_SIZE = 48;
+
+public:
+    TaskFunction()
+        : ops_(NULL) {}
+
+    template <class F, class = typename std::enable_if<
+                  !std::is_same<typename std::decay<F>::type, TaskFunction>::value>::type>
+    TaskFunction(F&& f)
+        : ops_(NULL) {
+        typedef typename std::decay<F>::type Fn;
+        if (IsInline<Fn>::value) {
+            new (storage()) Fn(std::forward<F>(f));
+            ops_ = &InlineOps<Fn>::ops;
+        } else {
+            ptr_ = new Fn(std::forward<F>(f));
+            ops_ = &HeapOps<Fn>::ops;
+        }
+    }
+
+    TaskFunction(TaskFunction&& other)
+        : ops_(other.ops_) {
+        if (ops_) {
+            ops_->move(storage(), other.storage());
+            other.ops_ = NULL;
+        }
+    }
+
+    TaskFunction& operator=(TaskFunction&& other) {
+        if (this != &other) {
+            reset();
+            if (other.ops_) {
+                other.ops_->move(storage(), other.storage());
+                ops_ = other.ops_;
+                other.ops_ = NULL;
+            }
+        }
+        return *this;
+    }
+
+    TaskFunction(const TaskFunction&) = delete;
+    TaskFunction& operator=(const TaskFunction&) = delete;
+
+    ~TaskFunction() {
+        reset();
+    }
+
+public:
+    void operator()() {
+        ops_->invoke(storage());
+    }
+
+    explicit operator bool() const {
+        return ops_ != NULL;
+    }
+
+    /**
+     * Destroys the callable, leaving the function empty.
+     */
+    void reset() {
+        if (ops_) {
+            ops_->destroy(storage());
+            ops_ = NULL;
+        }
+    }
+
+private:
+    struct Ops {
+        void (*invoke)(void* storage);
+        void (*move)(void* to, void* from);     // from is left destroyed
+        void (*destroy)(void* storage);
+    };
+
+    template <class Fn>
+    struct IsInline {
+        static const bool value = sizeof(Fn) <= INLINE_SIZE
+                                  && std::alignment_of<Fn>::value <= std::alignment_of<max_align_t>::value
+                                  && std::is_nothrow_move_constructible<Fn>::value;
+    };
+
+    template <class Fn>
+    struct InlineOps {
+        static void invoke(void* storage) {
+            (*static_cast<Fn*>(storage))();
+        }
+        static void move(void* to, void* from) {
+            new (to) Fn(std::move(*static_cast<Fn*>(from)));
+            static_cast<Fn*>(from)->~Fn();
+        }
+        static void destroy(void* storage) {
+            static_cast<Fn*>(storage)->~Fn();
+        }
+        static const Ops ops;
+    };
+
+    template <class Fn>
+    struct HeapOps {
+        static void invoke(void* storage) {
+            (**static_cast<Fn**>(storage))();
+        }
+        static void move(void* to, void* from) {
+            *static_cast<Fn**>(to) = *static_cast<Fn**>(from);
+        }
+        static void destroy(void* storage) {
+            delete *static_cast<Fn**>(storage);
+        }
+        static const Ops ops;
+    };
+
+    void* storage() {
+        return &buffer_;
+    }
+
+    const Ops* ops_;
+    union {
+        typename std::aligned_storage<INLINE_SIZE, std::alignment_of<max_align_t>::value>::type buffer_;
+        void* ptr_;
+    };
+};
+
+template <class Fn>
+const TaskFunction::Ops TaskFunction::InlineOps<Fn>::ops = {
+    &TaskFunction::InlineOps<Fn>::invoke,
+    &TaskFunction::InlineOps<Fn>::move,
+    &TaskFunction::InlineOps<Fn>::destroy
+};
+
+template <class Fn>
+const TaskFunction::Ops TaskFunction::HeapOps<Fn>::ops = {
+    &TaskFunction::HeapOps<Fn>::invoke,
+    &TaskFunction::HeapOps<Fn>::move,
+    &TaskFunction::HeapOps<Fn>::destroy
+};
+
+#endif
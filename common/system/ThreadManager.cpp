@@ -1,16 +1,934 @@
 #include "ThreadManager.h"
+#include <errno.h>
+#include <sched.h>
 #include <stdexcept>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <deque>
 #include <set>
-#include <map>
+#include <unordered_map>
+#include <vector>
 #include "../logcpp/log.h"
 #include "../utils/utime.h"
 #include "Monitor.h"
+#include "MPMCRing.h"
 #include "Thread.h"
 
+// slots of the lock-free part of the task queue, more pending tasks go to a locked list
+#define THREAD_MANAGER_RING_SIZE 4096
+// most tasks a worker dequeues at once when the backlog is deep
+#define THREAD_MANAGER_BATCH_MAX 16
+
+/**
+ * A queued task, either a Runnable or a callable handed to submit().
+ *
+ * Tasks are pooled by TaskPool and shared through TaskRef by intrusive reference
+ * counting, so queuing one allocates nothing in steady state. The pool recycles a
+ * task when its last reference is dropped, and keeps the memory for good, so a
+ * TaskHandle can always look at the task it names.
+ *
+ * The state word packs a generation (high 32 bits), bumped on every recycling,
+ * with the task state; every state change is a CAS on it that also checks the
+ * generation, so a stale handle matches nothing.
+ */
+class ThreadManager::Task {
+public:
+    enum STATE { WAITING, EXECUTING, TIMEDOUT, COMPLETE, REMOVED, FREE = 0xff };
+
+    Task()
+        : word_(pack(1, FREE))
+        , refs_(0)
+        , next_(0)
+        , index_(0)
+        , owner_(NULL)
+        , expireTime_(0LL)
+        , queueTime_(0LL) {}
+
+public:
+    void run() {
+        if (executing()) {
+            if (runnable_) {
+                runnable_->run();
+            } else {
+                function_();
+            }
+            transit(getId(), EXECUTING, COMPLETE);
+        }
+    }
+
+    inline const std::shared_ptr<Runnable>& getRunnable() const {
+        return runnable_;
+    }
+
+    /**
+     * \returns the task as a Runnable, wrapping the callable of a submitted task.
+     * Only for a task that has been claimed and will not be run.
+     */
+    std::shared_ptr<Runnable> takeRunnable();
+
+    inline int64_t getExpireTime() const {
+        return expireTime_;
+    }
+
+    /**
+     * \returns when the task was created, see Util::tscTimeNsec()
+     */
+    inline int64_t getQueueTime() const {
+        return queueTime_;
+    }
+
+    inline uint64_t getId() const {
+        return ((uint64_t)(word_.load(std::memory_order_relaxed) >> 32) << 32) | index_;
+    }
+
+    /**
+     * Moves a waiting task to state, only one of the worker dequeuing it, remove()
+     * and the expiration sweep succeeds.
+     */
+    inline bool claim(STATE state) {
+        return transit(getId(), WAITING, state);
+    }
+
+    inline bool waiting() const {
+        return (uint32_t)word_.load(std::memory_order_acquire) == WAITING;
+    }
+
+    inline bool executing() const {
+        return (uint32_t)word_.load(std::memory_order_acquire) == EXECUTING;
+    }
+
+    /**
+     * Moves the task named by id from one state to another, fails if it is in
+     * another state or has been recycled.
+     */
+    inline bool transit(uint64_t id, uint32_t from, uint32_t to) {
+        uint32_t generation = (uint32_t)(id >> 32);
+        uint64_t expected = pack(generation, from);
+        return word_.compare_exchange_strong(expected, pack(generation, to));
+    }
+
+    /**
+     * \returns the manager that queued the generation named by id, NULL if the
+     * task has been recycled since
+     */
+    inline const ThreadManager::Impl* owner(uint64_t id) const {
+        // owner_ is stored before the word of its generation is published
+        uint64_t word = word_.load(std::memory_order_acquire);
+        if ((word >> 32) != (id >> 32) || (uint32_t)word == FREE) {
+            return NULL;
+        }
+        return owner_.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * \returns the manager that queued the task, for a caller holding a reference
+     */
+    inline ThreadManager::Impl* getOwner() const {
+        return owner_.load(std::memory_order_relaxed);
+    }
+
+    inline void addRef() {
+        refs_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    inline void release();
+
+private:
+    friend class TaskPool;
+    friend class ThreadManager::Impl;
+
+    static uint64_t pack(uint32_t generation, uint32_t state) {
+        return ((uint64_t)generation << 32) | state;
+    }
+
+    std::atomic<uint64_t> word_;
+    std::atomic<uint32_t> refs_;
+    std::atomic<uint32_t> next_;            // while on the free stack of TaskPool
+    uint32_t index_;
+    std::atomic<ThreadManager::Impl*> owner_;
+    std::shared_ptr<Runnable> runnable_;
+    TaskFunction function_;
+    int64_t expireTime_;        // Util::coarseTime(), 0 for none
+    int64_t queueTime_;
+};
+
+/**
+ * Reference to a pooled Task, what the queues and the workers pass around.
+ */
+class TaskRef {
+public:
+    TaskRef()
+        : task_(NULL) {}
+    // adopts a reference
+    explicit TaskRef(ThreadManager::Task* task)
+        : task_(task) {}
+    TaskRef(const TaskRef& other)
+        : task_(other.task_) {
+        if (task_) {
+            task_->addRef();
+        }
+    }
+    TaskRef(TaskRef&& other)
+        : task_(other.task_) {
+        other.task_ = NULL;
+    }
+
+    ~TaskRef() {
+        reset();
+    }
+
+    TaskRef& operator=(const TaskRef& other) {
+        TaskRef(other).swap(*this);
+        return *this;
+    }
+
+    TaskRef& operator=(TaskRef&& other) {
+        TaskRef(std::move(other)).swap(*this);
+        return *this;
+    }
+
+public:
+    ThreadManager::Task* operator->() const {
+        return task_;
+    }
+
+    ThreadManager::Task& operator*() const {
+        return *task_;
+    }
+
+    explicit operator bool() const {
+        return task_ != NULL;
+    }
+
+    void reset() {
+        if (task_) {
+            ThreadManager::Task* task = task_;
+            task_ = NULL;
+            task->release();
+        }
+    }
+
+    void swap(TaskRef& other) {
+        std::swap(task_, other.task_);
+    }
+
+private:
+    ThreadManager::Task* task_;
+};
+
+/**
+ * Process wide pool of Task objects, shared by all the thread managers.
+ *
+ * Tasks are allocated in chunks that are never freed and named by their index.
+ * Every thread keeps a small cache of free indices, so getting and recycling a
+ * task is usually a few plain loads and stores; the caches trade batches with a
+ * lock-free stack whose head is tagged against ABA. A thread that exits gives
+ * its cache back.
+ */
+class TaskPool {
+public:
+    static TaskPool& instance() {
+        // never destroyed, tasks may still be released by threads running at exit
+        static TaskPool* pool = new TaskPool();
+        return *pool;
+    }
+
+public:
+    /**
+     * \returns a waiting task with one reference, NULL if the pool is exhausted
+     */
+    ThreadManager::Task* acquire(ThreadManager::Impl* owner) {
+        Cache& cache = localCache();
+        uint32_t index;
+        if (cache.count_ > 0 && cache.count_ != Cache::CLOSED) {
+            index = cache.indices_[--cache.count_];
+        } else {
+            index = refill(cache);
+            if (index == NIL) {
+                return NULL;
+            }
+        }
+        ThreadManager::Task& task = get(index);
+        uint32_t generation = (uint32_t)(task.word_.load(std::memory_order_relaxed) >> 32);
+        task.refs_.store(1, std::memory_order_relaxed);
+        task.owner_.store(owner, std::memory_order_relaxed);
+        task.word_.store(ThreadManager::Task::pack(generation, ThreadManager::Task::WAITING),
+                         std::memory_order_release);
+        return &task;
+    }
+
+    /**
+     * Called when the last reference is dropped.
+     */
+    void recycle(ThreadManager::Task* task) {
+        task->runnable_.reset();
+        task->function_.reset();
+        task->expireTime_ = 0LL;
+        uint32_t generation = (uint32_t)(task->word_.load(std::memory_order_relaxed) >> 32) + 1;
+        if (generation == 0) {
+            generation = 1;     // 0 stays reserved for invalid handles
+        }
+        task->word_.store(ThreadManager::Task::pack(generation, ThreadManager::Task::FREE),
+                          std::memory_order_release);
+
+        Cache& cache = localCache();
+        if (cache.count_ == Cache::CLOSED) {
+            push(task->index_, task->index_);
+            return;
+        }
+        if (cache.count_ == Cache::SIZE) {
+            spill(cache, Cache::SIZE / 2);
+        }
+        cache.indices_[cache.count_++] = task->index_;
+    }
+
+    /**
+     * \returns the task named by a handle, NULL if there is none
+     */
+    ThreadManager::Task* find(uint64_t id) {
+        uint32_t index = (uint32_t)id;
+        if (id == 0 || index / CHUNK_SIZE >= chunkCount_.load(std::memory_order_acquire)) {
+            return NULL;
+        }
+        return &get(index);
+    }
+
+private:
+    static const uint32_t NIL = 0xffffffff;
+    static const uint32_t CHUNK_SIZE = 1024;
+    static const uint32_t MAX_CHUNKS = 4096;     // 4M tasks queued at once
+
+    // Trivially destructible so that it can still be used while the thread exits,
+    // CacheCloser gives the indices back and closes it.
+    struct Cache {
+        static const uint32_t SIZE = 128;
+        static const uint32_t CLOSED = 0xffffffff;
+
+        uint32_t count_;
+        uint32_t indices_[SIZE];
+    };
+
+    struct CacheCloser {
+        ~CacheCloser() {
+            TaskPool::instance().close(localCache());
+        }
+    };
+
+    TaskPool()
+        : chunkCount_(0)
+        , free_(NIL) {
+        for (size_t i = 0; i < MAX_CHUNKS; ++i) {
+            chunks_[i].store(NULL, std::memory_order_relaxed);
+        }
+    }
+
+    static Cache& localCache() {
+        static thread_local Cache cache = { 0, { 0 } };
+        static thread_local CacheCloser closer;
+        (void)closer;
+        return cache;
+    }
+
+    ThreadManager::Task& get(uint32_t index) {
+        return chunks_[index / CHUNK_SIZE].load(std::memory_order_acquire)[index % CHUNK_SIZE];
+    }
+
+    /**
+     * Takes up to half a cache from the free stack, or a new chunk.
+     * \returns an index for the caller, NIL if the pool is exhausted
+     */
+    uint32_t refill(Cache& cache) {
+        uint32_t want = cache.count_ == Cache::CLOSED ? 1 : Cache::SIZE / 2;
+        uint64_t head = free_.load(std::memory_order_acquire);
+        for (;;) {
+            uint32_t first = (uint32_t)head;
+            if (first == NIL) {
+                return grow(cache);
+            }
+            // walk to the last task of the batch; the tag makes the CAS fail if
+            // any of them was popped meanwhile
+            uint32_t last = first;
+            uint32_t count = 1;
+            for (; count < want; ++count) {
+                uint32_t next = get(last).next_.load(std::memory_order_relaxed);
+                if (next == NIL) {
+                    break;
+                }
+                last = next;
+            }
+            uint32_t rest = get(last).next_.load(std::memory_order_relaxed);
+            uint64_t tag = (head >> 32) + 1;
+            if (free_.compare_exchange_weak(head, (tag << 32) | rest, std::memory_order_acq_rel)) {
+                uint32_t index = get(first).next_.load(std::memory_order_relaxed);
+                for (uint32_t i = 1; i < count; ++i) {
+                    cache.indices_[cache.count_++] = index;
+                    index = get(index).next_.load(std::memory_order_relaxed);
+                }
+                return first;
+            }
+        }
+    }
+
+    void spill(Cache& cache, uint32_t count) {
+        uint32_t first = cache.indices_[cache.count_ - 1];
+        uint32_t last = first;
+        for (uint32_t i = 1; i < count; ++i) {
+            uint32_t index = cache.indices_[cache.count_ - 1 - i];
+            get(last).next_.store(index, std::memory_order_relaxed);
+            last = index;
+        }
+        cache.count_ -= count;
+        push(first, last);
+    }
+
+    void close(Cache& cache) {
+        if (cache.count_ > 0 && cache.count_ != Cache::CLOSED) {
+            spill(cache, cache.count_);
+        }
+        cache.count_ = Cache::CLOSED;
+    }
+
+    /**
+     * Pushes the chain first..last, already linked through next_, on the free stack.
+     */
+    void push(uint32_t first, uint32_t last) {
+        uint64_t head = free_.load(std::memory_order_relaxed);
+        for (;;) {
+            get(last).next_.store((uint32_t)head, std::memory_order_relaxed);
+            uint64_t tag = (head >> 32) + 1;
+            if (free_.compare_exchange_weak(head, (tag << 32) | first, std::memory_order_acq_rel)) {
+                return;
+            }
+        }
+    }
+
+    /**
+     * Adds a chunk, keeps its first task for the caller, fills the cache and frees
+     * the rest.
+     * \returns the index of the first task, NIL if the pool is full
+     */
+    uint32_t grow(Cache& cache) {
+        Guard g(growMutex_);
+        uint32_t chunk = chunkCount_.load(std::memory_order_relaxed);
+        if (chunk == MAX_CHUNKS) {
+            LOG_CXX(LOG_ERROR) << "no task left in the pool";
+            return NIL;
+        }
+        ThreadManager::Task* tasks = new ThreadManager::Task[CHUNK_SIZE];
+        uint32_t base = chunk * CHUNK_SIZE;
+        for (uint32_t i = 0; i < CHUNK_SIZE; ++i) {
+            tasks[i].index_ = base + i;
+            tasks[i].next_.store(base + i + 1, std::memory_order_relaxed);
+        }
+        chunks_[chunk].store(tasks, std::memory_order_release);
+        chunkCount_.store(chunk + 1, std::memory_order_release);
+
+        uint32_t first = 1;
+        if (cache.count_ != Cache::CLOSED) {
+            for (; first < Cache::SIZE / 2; ++first) {
+                cache.indices_[cache.count_++] = base + first;
+            }
+        }
+        push(base + first, base + CHUNK_SIZE - 1);
+        return base;
+    }
+
+    std::atomic<ThreadManager::Task*> chunks_[MAX_CHUNKS];
+    std::atomic<uint32_t> chunkCount_;
+    std::atomic<uint64_t> free_;        // ABA tag in the high 32 bits, top task index in the low ones
+    Mutex growMutex_;
+};
+
+inline void ThreadManager::Task::release() {
+    if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        TaskPool::instance().recycle(this);
+    }
+}
+
+/**
+ * Runnable owning the callable of a submitted task, for the interfaces that hand
+ * pending tasks back: removeNextPending() and the expire callback.
+ */
+class FunctionTask : public Runnable {
+public:
+    explicit FunctionTask(TaskFunction&& function)
+        : function_(std::move(function)) {}
+
+    void run() {
+        if (function_) {
+            function_();
+        }
+    }
+
+private:
+    TaskFunction function_;
+};
+
+std::shared_ptr<Runnable> ThreadManager::Task::takeRunnable() {
+    if (runnable_ || !function_) {
+        return runnable_;
+    }
+    return std::shared_ptr<Runnable>(new FunctionTask(std::move(function_)));
+}
+
+/**
+ * Pending tasks, one FIFO per task class, served by deficit round robin.
+ *
+ * Every backlogged class takes its turn in the active list and dequeues up to
+ * its weight in tasks before moving to the back, so under contention classes
+ * get workers in proportion to their weights whatever their arrival rates.
+ * With a single class this is a plain FIFO.
+ *
+ * Not synchronized, it is kept under TaskQueue::lock_.
+ */
+class FairTaskQueue {
+public:
+    typedef TaskRef Item;
+
+    FairTaskQueue()
+        : size_(0) {}
+
+public:
+    void push(uint32_t classId, const Item& item) {
+        Class& c = classes_[classId];
+        c.tasks_.push_back(item);
+        if (!c.active_) {
+            c.active_ = true;
+            active_.push_back(&c);
+        }
+        ++size_;
+    }
+
+    /**
+     * Dequeues the next task in DRR order, the queue must not be empty.
+     */
+    Item pop() {
+        Class* c = active_.front();
+        if (c->deficit_ == 0) {
+            c->deficit_ = c->weight_;   // start of the class' turn
+        }
+
+        Item item = c->tasks_.front();
+        c->tasks_.pop_front();
+        --c->deficit_;
+        --size_;
+
+        if (c->tasks_.empty()) {
+            deactivate(c);
+        } else if (c->deficit_ == 0) {
+            active_.pop_front();
+            active_.push_back(c);
+        }
+        return item;
+    }
+
+    /**
+     * Erases the tasks for which erase(item) returns true, front to back within each class.
+     * \returns the number of erased tasks
+     */
+    template <class Pred>
+    size_t eraseIf(Pred erase, bool justOne) {
+        size_t count = 0;
+        for (ClassMap::iterator ic = classes_.begin(); ic != classes_.end(); ++ic) {
+            Class& c = ic->second;
+            for (std::deque<Item>::iterator it = c.tasks_.begin(); it != c.tasks_.end(); ) {
+                if (!erase(*it)) {
+                    ++it;
+                    continue;
+                }
+                it = c.tasks_.erase(it);
+                --size_;
+                ++count;
+                if (justOne) {
+                    break;
+                }
+            }
+            if (c.active_ && c.tasks_.empty()) {
+                deactivate(&c);
+            }
+            if (justOne && count > 0) {
+                break;
+            }
+        }
+        return count;
+    }
+
+    void weight(uint32_t classId, uint32_t value) {
+        Class& c = classes_[classId];
+        c.weight_ = value > 0 ? value : 1;
+        if (c.deficit_ > c.weight_) {
+            c.deficit_ = c.weight_;
+        }
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+private:
+    struct Class {
+        uint32_t weight_;
+        uint32_t deficit_;      // dequeues left in the current turn
+        bool active_;           // listed in active_
+        std::deque<Item> tasks_;
+
+        Class()
+            : weight_(1)
+            , deficit_(0)
+            , active_(false) {}
+    };
+
+    void deactivate(Class* c) {
+        c->active_ = false;
+        c->deficit_ = 0;
+        if (active_.front() == c) {
+            active_.pop_front();
+        } else {
+            active_.erase(std::find(active_.begin(), active_.end(), c));
+        }
+    }
+
+    // elements of an unordered_map keep their address across rehashing
+    typedef std::unordered_map<uint32_t, Class> ClassMap;
+    ClassMap classes_;
+    std::deque<Class*> active_;
+    size_t size_;
+};
+
+/**
+ * The task queue of ThreadManager::Impl, safe to use without the manager's mutex_.
+ *
+ * Tasks of class 0 go through a lock-free MPMCRing. The lists behind lock_ only
+ * come into play when the ring is full (overflowTasks_), when pending tasks have to
+ * be searched (frontTasks_) and once task classes are in use (fairTasks_); consumers
+ * only take lock_ when the ring is empty and those lists are not.
+ *
+ * FIFO order is kept: while overflowTasks_ holds tasks producers append there
+ * instead of the ring and consumers move them back to the ring once it is drained,
+ * eraseIf() moves what is in the ring to frontTasks_ which is served first, and
+ * tasks queued before fair queueing was switched on still go first.
+ */
+class TaskQueue {
+public:
+    typedef FairTaskQueue::Item Item;
+
+    explicit TaskQueue(size_t capacity)
+        : ring_(capacity)
+        , fair_(false)
+        , size_(0)
+        , locked_(0)
+        , front_(0)
+        , overflow_(0)
+        , lifo_(false)
+        , fresh_(0) {}
+
+public:
+    /**
+     * \returns false if max is not 0 and the queue already holds max tasks
+     */
+    bool push(uint32_t classId, const Item& item, size_t max = 0) {
+        // counted before it is visible, so that size() never goes below zero
+        size_t size = size_.load();
+        do {
+            if (max > 0 && size >= max) {
+                return false;
+            }
+        } while (!size_.compare_exchange_weak(size, size + 1));
+
+        if (classId == 0 && !fair_.load(std::memory_order_acquire)) {
+            if (lifo_.load(std::memory_order_relaxed)) {
+                Guard g(lock_);
+                freshTasks_.push_back(item);
+                ++fresh_;
+                ++locked_;
+                return true;
+            }
+            if (overflow_.load(std::memory_order_acquire) == 0 && ring_.tryPush(item)) {
+                return true;
+            }
+            Guard g(lock_);
+            overflowTasks_.push_back(item);
+            ++overflow_;
+            ++locked_;
+            return true;
+        }
+
+        Guard g(lock_);
+        fair_.store(true, std::memory_order_release);
+        fairTasks_.push(classId, item);
+        ++locked_;
+        return true;
+    }
+
+    /**
+     * Pushes the first count items, as many as max leaves room for, at once: one CAS
+     * on the ring or one hold of lock_.
+     * \returns the number of items pushed
+     */
+    size_t pushBatch(uint32_t classId, const Item* items, size_t count, size_t max = 0) {
+        size_t size = size_.load();
+        size_t n;
+        do {
+            n = count;
+            if (max > 0) {
+                if (size >= max) {
+                    return 0;
+                }
+                n = std::min(count, max - size);
+            }
+        } while (!size_.compare_exchange_weak(size, size + n));
+
+        if (classId == 0 && !fair_.load(std::memory_order_acquire)) {
+            if (lifo_.load(std::memory_order_relaxed)) {
+                Guard g(lock_);
+                freshTasks_.insert(freshTasks_.end(), items, items + n);
+                fresh_ += n;
+                locked_ += n;
+                return n;
+            }
+            size_t pushed = 0;
+            if (overflow_.load(std::memory_order_acquire) == 0) {
+                pushed = ring_.tryPushBatch(items, n);
+            }
+            if (pushed < n) {
+                Guard g(lock_);
+                overflowTasks_.insert(overflowTasks_.end(), items + pushed, items + n);
+                overflow_ += n - pushed;
+                locked_ += n - pushed;
+            }
+            return n;
+        }
+
+        Guard g(lock_);
+        fair_.store(true, std::memory_order_release);
+        for (size_t i = 0; i < n; ++i) {
+            fairTasks_.push(classId, items[i]);
+        }
+        locked_ += n;
+        return n;
+    }
+
+    /**
+     * \returns false if no task could be dequeued, which may also happen for a moment
+     *          while a push is in progress and size() already counts it
+     */
+    bool pop(Item& item) {
+        if (front_.load() == 0 && fresh_.load() == 0 && ring_.tryPop(item)) {
+            --size_;
+            return true;
+        }
+        if (locked_.load() == 0) {
+            return false;
+        }
+
+        Guard g(lock_);
+        if (!popLocked(item)) {
+            return false;
+        }
+        --size_;
+        return true;
+    }
+
+    /**
+     * Pops up to max tasks at once, with one CAS on the ring or one hold of lock_.
+     * \returns the number of tasks appended to items, which has room for them
+     */
+    size_t popBatch(std::vector<Item>& items, size_t max) {
+        size_t count = 0;
+        if (front_.load() == 0 && fresh_.load() == 0) {
+            count = ring_.tryPopBatch(items, max);
+        }
+        if (count == 0 && locked_.load() > 0) {
+            Guard g(lock_);
+            Item item;
+            while (count < max && popLocked(item)) {
+                items.push_back(std::move(item));
+                ++count;
+            }
+        }
+        size_ -= count;
+        return count;
+    }
+
+    /**
+     * Pops the task queued the longest ago, passing over freshTasks_.
+     */
+    bool popOldest(Item& item) {
+        if (front_.load() == 0 && ring_.tryPop(item)) {
+            --size_;
+            return true;
+        }
+        if (locked_.load() == 0) {
+            return false;
+        }
+
+        Guard g(lock_);
+        if (!popLocked(item, false)) {
+            return false;
+        }
+        --size_;
+        return true;
+    }
+
+    /**
+     * See FairTaskQueue::eraseIf(), the tasks are visited in queue order apart from
+     * the classes of fair queueing.
+     */
+    template <class Pred>
+    size_t eraseIf(Pred erase, bool justOne) {
+        Guard g(lock_);
+        Item item;
+        while (ring_.tryPop(item)) {
+            frontTasks_.push_back(item);
+            ++front_;
+            ++locked_;
+        }
+
+        size_t count = eraseIf(freshTasks_, erase, justOne);
+        fresh_ -= count;
+        if (!justOne || count == 0) {
+            size_t erased = eraseIf(frontTasks_, erase, justOne);
+            front_ -= erased;
+            count += erased;
+        }
+        if (!justOne || count == 0) {
+            size_t erased = eraseIf(overflowTasks_, erase, justOne);
+            overflow_ -= erased;
+            count += erased;
+        }
+        if (!justOne || count == 0) {
+            count += fairTasks_.eraseIf(erase, justOne);
+        }
+        locked_ -= count;
+        size_ -= count;
+        return count;
+    }
+
+    void weight(uint32_t classId, uint32_t value) {
+        Guard g(lock_);
+        fair_.store(true, std::memory_order_release);
+        fairTasks_.weight(classId, value);
+    }
+
+    /**
+     * While on, class 0 tasks are pushed to a stack popped before anything else, so
+     * the newest ones are served first. Classes under fair queueing stay FIFO.
+     */
+    void lifo(bool value) {
+        lifo_.store(value, std::memory_order_relaxed);
+    }
+
+    bool empty() const {
+        return size_.load() == 0;
+    }
+
+    size_t size() const {
+        return size_.load();
+    }
+
+private:
+    /**
+     * Pops from the lists behind lock_, which the caller holds, refilling the ring
+     * from overflowTasks_. size_ is left to the caller.
+     */
+    bool popLocked(Item& item, bool fresh = true) {
+        if (fresh && !freshTasks_.empty()) {
+            item = freshTasks_.back();
+            freshTasks_.pop_back();
+            --fresh_;
+            --locked_;
+        } else if (!frontTasks_.empty()) {
+            item = frontTasks_.front();
+            frontTasks_.pop_front();
+            --front_;
+            --locked_;
+        } else if (ring_.tryPop(item)) {
+        } else if (!overflowTasks_.empty()) {
+            item = overflowTasks_.front();
+            overflowTasks_.pop_front();
+            --overflow_;
+            --locked_;
+            // the ring is drained, move the backlog there so that the next pops are lock-free
+            while (!overflowTasks_.empty() && ring_.tryPush(overflowTasks_.front())) {
+                overflowTasks_.pop_front();
+                --overflow_;
+                --locked_;
+            }
+        } else if (!fairTasks_.empty()) {
+            item = fairTasks_.pop();
+            --locked_;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    template <class Pred>
+    static size_t eraseIf(std::deque<Item>& tasks, Pred& erase, bool justOne) {
+        size_t count = 0;
+        for (std::deque<Item>::iterator it = tasks.begin(); it != tasks.end(); ) {
+            if (!erase(*it)) {
+                ++it;
+                continue;
+            }
+            it = tasks.erase(it);
+            ++count;
+            if (justOne) {
+                break;
+            }
+        }
+        return count;
+    }
+
+private:
+    MPMCRing<Item> ring_;
+    std::atomic<bool> fair_;            // every class goes through fairTasks_ from now on
+    std::atomic<size_t> size_;
+    std::atomic<size_t> locked_;        // tasks in freshTasks_, frontTasks_, overflowTasks_ and fairTasks_
+    std::atomic<size_t> front_;         // tasks in frontTasks_
+    std::atomic<size_t> overflow_;      // tasks in overflowTasks_
+    Mutex lock_;
+    std::deque<Item> frontTasks_;       // older than anything in ring_
+    std::deque<Item> overflowTasks_;    // newer than anything in ring_
+    FairTaskQueue fairTasks_;
+    std::atomic<bool> lifo_;
+    std::atomic<size_t> fresh_;         // tasks in freshTasks_
+    std::deque<Item> freshTasks_;       // pushed while lifo_ was on, popped newest first
+};
+
+/**
+ * Identity and private state of a worker thread, reachable from that thread
+ * through current() while Worker::run() runs, so that any thread finds out
+ * whether it is a worker, and of which manager, without a lookup.
+ *
+ * Only the worker itself touches it; its counters are folded into the
+ * manager's once per batch instead of contending on them for every task.
+ */
+struct WorkerContext {
+    const ThreadManager::Impl* manager_;
+    int64_t queueWait_;         // nanoseconds, not folded yet
+    uint64_t dequeued_;         // not folded yet
+
+    explicit WorkerContext(const ThreadManager::Impl* manager)
+        : manager_(manager)
+        , queueWait_(0)
+        , dequeued_(0) {}
+
+    static WorkerContext*& current() {
+        static thread_local WorkerContext* context = NULL;
+        return context;
+    }
+};
+
 class ThreadManager::Impl : public ThreadManager {
     friend class ThreadManager::Task;
     friend class ThreadManager::Worker;
+    friend class PerCoreThreadManager;
 public:
     Impl()
         : workerCount_(0)
@@ -18,11 +936,32 @@ public:
         , idleCount_(0)
         , pendingTaskCountMax_(0)
         , expiredCount_(0)
+        , queueWaitTime_(0)
+        , dequeuedCount_(0)
+        , maxWaiters_(0)
+        , expireCallback_(NULL)
+        , removedCount_(0)
+        , heldCount_(0)
         , state_(ThreadManager::UNINITIALIZED)
         , threadFactory_(NULL)
+        , tasks_(THREAD_MANAGER_RING_SIZE)
+        , nextTimer_(INT64_MAX)
+        , nextExpire_(INT64_MAX)
+        , codelTarget_(0)
+        , codelInterval_(0)
+        , codelLifo_(false)
+        , codelArmed_(false)
+        , firstAbove_(0)
+        , dropNext_(0)
+        , dropCount_(0)
+        , dropping_(false)
+        , timerWaiter_(false)
         , monitor_(&mutex_)
         , maxMonitor_(&mutex_)
-        , workerMonitor_(&mutex_) {
+        , workerMonitor_(&mutex_)
+        , group_(NULL)
+        , shard_(0)
+        , cpu_(-1) {
     }
 
     ~Impl() {
@@ -33,6 +972,12 @@ public:
     virtual void start();
     virtual void stop();
 
+    /**
+     * First half of stop(): no task is taken from now on, the workers keep running
+     * the queued ones until stop() joins them.
+     */
+    void beginStop();
+
     virtual ThreadManager::STATE state() const {
         return state_;
     }
@@ -61,121 +1006,288 @@ public:
     }
 
     virtual size_t workerCount() {
-        Guard g(mutex_);
         return workerCount_;
     }
 
     virtual size_t pendingTaskCount() {
-        Guard g(mutex_);
-        return tasks_.size();
+        return pendingTasks();
     }
 
     virtual size_t totalTaskCount() {
-        Guard g(mutex_);
-        return tasks_.size() + workerCount_ - idleCount_;
+        size_t workers = workerCount_;
+        size_t idle = idleCount_;
+        return pendingTasks() + heldCount_.load(std::memory_order_relaxed) + (workers > idle ? workers - idle : 0);
     }
 
     virtual size_t pendingTaskCountMax() {
-        Guard g(mutex_);
         return pendingTaskCountMax_;
     }
 
     virtual size_t expiredTaskCount() {
-        Guard g(mutex_);
         return expiredCount_;
     }
 
+    virtual uint64_t queueWaitTime() {
+        return queueWaitTime_ / 1000;
+    }
+
+    virtual uint64_t dequeuedTaskCount() {
+        return dequeuedCount_;
+    }
+
     virtual void pendingTaskCountMax(const size_t value) {
-        Guard g(mutex_);
         pendingTaskCountMax_ = value;
     }
 
-    virtual void add(std::shared_ptr<Runnable> value, int64_t timeout, int64_t expiration);
+    virtual TaskHandle add(std::shared_ptr<Runnable> value, int64_t timeout, int64_t expiration) {
+        return addToClass(0, value, timeout, expiration);
+    }
+
+    virtual TaskHandle addToClass(uint32_t classId, std::shared_ptr<Runnable> value, int64_t timeout, int64_t expiration);
+
+    virtual TaskHandle submitToClass(uint32_t classId, TaskFunction&& value, int64_t timeout, int64_t expiration);
+
+    virtual size_t addBatch(const std::vector<std::shared_ptr<Runnable> >& tasks, int64_t timeout,
+                            int64_t expiration, std::vector<TaskHandle>* handles);
+
+    virtual void setClassWeight(uint32_t classId, uint32_t weight) {
+        tasks_.weight(classId, weight);
+    }
+
+    virtual TimerHandle scheduleAfter(std::shared_ptr<Runnable> task, int64_t delay) {
+        return schedule(task, delay, 0LL);
+    }
+
+    virtual TimerHandle scheduleAt(std::shared_ptr<Runnable> task, int64_t time) {
+        return schedule(task, time - Util::currentTime(), 0LL);
+    }
+
+    virtual TimerHandle scheduleEvery(std::shared_ptr<Runnable> task, int64_t period);
 
     virtual void remove(std::shared_ptr<Runnable> task);
 
+    virtual bool remove(TaskHandle handle);
+
     virtual std::shared_ptr<Runnable> removeNextPending();
 
     virtual void removeExpiredTasks() {
-        removeExpired(false);
+        size_t expired = expireTasks(true);
+        if (expired > 0) {
+            taskDequeued(expired);
+        }
     }
 
     virtual void setExpireCallback(ExpireCallback expireCallback);
 
-private:
+    virtual void setControlledDelay(int64_t target, int64_t interval, bool lifo);
+
+private:
+    TimerHandle schedule(std::shared_ptr<Runnable> task, int64_t delay, int64_t period);
+
+    /**
+     * \returns a waiting task from the pool, empty if the pool is exhausted
+     */
+    TaskRef newTask(int64_t expiration);
+
+    /**
+     * Queues a new task, blocking while the queue is full, and indexes its expiration.
+     */
+    TaskHandle enqueue(uint32_t classId, const TaskRef& task, int64_t timeout);
+
+    /**
+     * Moves scheduled tasks that are due into the task queue, returns how many.
+     * The caller is responsible for acquiring a lock on the class mutex_.
+     */
+    size_t promoteTimers();
+
+    /**
+     * Publishes the earliest deadline of timers_ to nextTimer_, called under mutex_
+     * whenever timers_ changes.
+     */
+    void updateNextTimer();
+
+    /**
+     * \returns whether a scheduled task may be due, without locking
+     */
+    bool timersDue() const;
+
+    /**
+     * Blocks an idle worker until it is notified. One idle worker at a time sleeps
+     * only until the earliest scheduled task is due. The caller holds mutex_.
+     */
+    void waitForWork();
+
+    /**
+     * Blocks a producer while the queue is at pendingTaskCountMax().
+     * \returns false if the task must not be added
+     */
+    bool waitForRoom(int64_t timeout);
+
+    /**
+     * Wakes the producers blocked in waitForRoom() once a worker took count tasks.
+     */
+    void taskDequeued(size_t count = 1);
+
+    /**
+     * Adds the time a task spent queued, up to now that a worker gets to it, to the
+     * worker's counters.
+     * \returns that time in nanoseconds
+     */
+    int64_t accountQueueWait(WorkerContext& context, const TaskRef& task);
+
+    /**
+     * The CoDel state machine, run for every task a worker gets to.
+     * \param wait  how long the task was queued, in nanoseconds
+     * \returns whether the task has to be dropped
+     */
+    bool shed(int64_t wait);
+
+    /**
+     * Enters or leaves the dropping state of CoDel, under codelMutex_.
+     */
+    void overloaded(bool value);
+
+    /**
+     * Expires the oldest pending task, what CoDel drops in LIFO order.
+     * \returns false if there was none
+     */
+    bool dropOldest();
+
+    /**
+     * Moves the counters of a worker to queueWaitTime_ and dequeuedCount_.
+     */
+    void foldQueueWait(WorkerContext& context);
+
+    /**
+     * How many tasks a worker takes at once: its share of the backlog, up to
+     * THREAD_MANAGER_BATCH_MAX, and a single task while any worker is idle.
+     */
+    size_t batchSize() const;
+
+    /**
+     * Tasks in tasks_ that have not been expired or removed yet.
+     */
+    size_t pendingTasks() const;
+
+    /**
+     * Enters count tasks that have an expiration into expiring_.
+     */
+    void indexExpiration(const TaskRef* tasks, size_t count);
+
+    /**
+     * Wakes as many idle workers as needed for count new tasks.
+     */
+    void tasksQueued(size_t count);
+
+    /**
+     * Expires the pending tasks whose expiration has passed, earliest first, and runs
+     * the expire callback for them. They stay in tasks_ and are skipped when dequeued.
+     * \param[in]  wait  if false, give up when another thread is already sweeping
+     * \returns the number of expired tasks
+     */
+    size_t expireTasks(bool wait);
+
+    /**
+     * Amortized sweeping, run by the workers: expireTasks() if a task may have expired.
+     */
+    void expireTasksIfDue();
+
+    /**
+     * \returns whether it is acceptable to block: not on a worker of this manager
+     */
+    bool canSleep() const;
+
+    /**
+     * Lowers the maximum worker count and blocks until enough worker threads complete
+     * to get to the new maximum worker limit.  The caller is responsible for acquiring
+     * a lock on the class mutex_.
+     */
+    void removeWorkersUnderLock(size_t value);
+
+    /**
+     * Binds the calling worker thread to cpu_, if the manager is a pinned shard.
+     */
+    void pinWorker();
+
     /**
-     * Remove one or more expired tasks.
-     * \param[in]  justOne  if true, try to remove just one task and return
+     * \returns whether a peer shard has tasks queued and no idle worker to run them
      */
-    void removeExpired(bool justOne);
+    bool stealable() const;
 
     /**
-     * \returns whether it is acceptable to block, depending on the current thread id
+     * Moves up to half of the backlog of the first stealable peer, at most
+     * THREAD_MANAGER_BATCH_MAX tasks, into batch.
+     * \returns the peer the tasks were taken from, NULL if none
      */
-    bool canSleep() const;
+    ThreadManager::Impl* steal(std::vector<TaskRef>& batch);
 
     /**
-     * Lowers the maximum worker count and blocks until enough worker threads complete
-     * to get to the new maximum worker limit.  The caller is responsible for acquiring
-     * a lock on the class mutex_.
+     * Wakes an idle worker of a peer shard to steal from this one, called once this
+     * shard queued more tasks than it has workers and none of them is idle.
      */
-    void removeWorkersUnderLock(size_t value);
+    void wakeThief();
 
 private:
-    size_t workerCount_;
-    size_t workerMaxCount_;
-    size_t idleCount_;
-    size_t pendingTaskCountMax_;
-    size_t expiredCount_;
-    ExpireCallback expireCallback_;
-
-    ThreadManager::STATE state_;
+    // The counters and state_ are read without a lock; workerCount_, workerMaxCount_
+    // and state_ are only changed under mutex_.
+    std::atomic<size_t> workerCount_;
+    std::atomic<size_t> workerMaxCount_;
+    std::atomic<size_t> idleCount_;
+    std::atomic<size_t> pendingTaskCountMax_;
+    std::atomic<size_t> expiredCount_;
+    std::atomic<uint64_t> queueWaitTime_;       // nanoseconds
+    std::atomic<uint64_t> dequeuedCount_;
+    std::atomic<size_t> maxWaiters_;            // producers blocked on maxMonitor_
+    std::atomic<ExpireCallback> expireCallback_;
+    std::atomic<int64_t> removedCount_;         // tasks expired or removed but still in tasks_
+    std::atomic<size_t> heldCount_;             // tasks in the batches of the workers, not started yet
+
+    std::atomic<ThreadManager::STATE> state_;
     std::shared_ptr<ThreadFactory> threadFactory_;
 
-    typedef std::deque< std::shared_ptr<Task> > TaskQueue;
     TaskQueue tasks_;
-    Mutex mutex_;
+    typedef TimerHeap< std::shared_ptr<Runnable> > TimerQueue;
+    TimerQueue timers_;
+    std::atomic<int64_t> nextTimer_;            // timers_.next() in nanoseconds, INT64_MAX when empty
+
+    // Pending tasks that have an expiration, as a min-heap on the expire time. Entries
+    // of tasks that were run or removed meanwhile are dropped once they reach the top,
+    // or all at once when they make up most of the heap.
+    typedef std::pair<int64_t, TaskRef> Expiring;
+    struct LaterExpiring {
+        bool operator()(const Expiring& a, const Expiring& b) const {
+            return a.first > b.first;
+        }
+    };
+    Mutex expireMutex_;                         // guards expiring_
+    std::vector<Expiring> expiring_;
+    std::atomic<int64_t> nextExpire_;           // expiring_.front().first, INT64_MAX when empty
+
+    // CoDel, see setControlledDelay(), in nanoseconds of Util::tscTimeNsec()
+    std::atomic<int64_t> codelTarget_;          // 0 when off
+    std::atomic<int64_t> codelInterval_;
+    std::atomic<bool> codelLifo_;
+    std::atomic<bool> codelArmed_;              // firstAbove_ is set or dropping_, see shed()
+    Mutex codelMutex_;                          // guards the state below, only ever try-locked
+    int64_t firstAbove_;                        // when the wait will have been above target an interval, 0 if it is not
+    int64_t dropNext_;
+    uint32_t dropCount_;
+    bool dropping_;
+
+    bool timerWaiter_;
+    Mutex mutex_;                               // worker lifecycle, timers_ and the monitors
     Monitor monitor_;
     Monitor maxMonitor_;
     Monitor workerMonitor_;       // used to synchronize changes in worker count
 
     std::set<Thread *> workers_;
     std::set<Thread *> deadWorkers_;
-    std::map<const Thread::id_t, Thread*> idMap_;
-};
-
-class ThreadManager::Task : public Runnable {
-public:
-    enum STATE { WAITING, EXECUTING, TIMEDOUT, COMPLETE };
-
-    Task(std::shared_ptr<Runnable> runnable, int64_t expiration = 0LL)
-        : runnable_(runnable),
-          state_(WAITING),
-          expireTime_(expiration != 0LL ? Util::currentTime() + expiration : 0LL) {}
-
-    ~Task() {}
-
-public:
-    void run() {
-        if (state_ == EXECUTING) {
-            runnable_->run();
-            state_ = COMPLETE;
-        }
-    }
-
-    inline std::shared_ptr<Runnable> getRunnable() {
-        return runnable_;
-    }
-
-    inline int64_t getExpireTime() const {
-        return expireTime_;
-    }
 
-private:
-    std::shared_ptr<Runnable> runnable_;
-    friend class ThreadManager::Worker;
-    STATE state_;
-    int64_t expireTime_;
+    // Set before start() when the manager is a shard of a PerCoreThreadManager.
+    const ThreadManager* group_;                // the sharded manager, NULL if not a shard
+    size_t shard_;                              // index in peers_
+    int cpu_;                                   // CPU the workers are bound to, -1 for none
+    std::vector<ThreadManager::Impl*> peers_;   // all the shards, this one included
 };
 
 class ThreadManager::Worker : public Runnable {
@@ -192,81 +1304,158 @@ private:
                || (manager_->state_ == JOINING && !manager_->tasks_.empty());
     }
 
-public:
-    void run() {
+    /**
+     * Slow path of the loop, taken when the queue looks empty, a timer may be due
+     * or this worker may have to retire. Sleeps until a task is dequeued, or until
+     * a peer shard has tasks to steal, which the caller does after the lock is
+     * released.
+     * \returns false if the worker has to exit
+     */
+    bool waitForTask(TaskRef& task) {
         Guard g(manager_->mutex_);
-        bool active = manager_->workerCount_ < manager_->workerMaxCount_;
+        size_t promoted = manager_->promoteTimers();
+        bool active = isActive();
+        while (active && !manager_->tasks_.pop(task)) {
+            // Announced before looking at the queue again: add() reads idleCount_
+            // after pushing, so either it sees this worker or this worker sees its task.
+            manager_->idleCount_++;
+            bool steal = manager_->stealable();
+            if (!steal && manager_->tasks_.empty()) {
+                manager_->waitForWork();
+                steal = manager_->stealable();
+            } else if (!steal) {
+                // counted but not pushed yet, let the producer finish
+                sched_yield();
+            }
+            manager_->idleCount_--;
+            active = isActive();
+            promoted += manager_->promoteTimers();
+            if (steal) {
+                break;
+            }
+        }
+
         if (active) {
-            if (++manager_->workerCount_ == manager_->workerMaxCount_) {
-                manager_->workerMonitor_.notify();
+            // hand the other due tasks to idle workers, and make sure one of
+            // them keeps watching the timers
+            for (; promoted > 1 && manager_->idleCount_ > 0; --promoted) {
+                manager_->monitor_.notify();
+            }
+            if (!manager_->timers_.empty() && !manager_->timerWaiter_ && manager_->idleCount_ > 0) {
+                manager_->monitor_.notify();
             }
         }
+        return active;
+    }
 
-        while (active) {
-            active = isActive();
+    /**
+     * \param wait  how long the task was queued, in nanoseconds
+     */
+    void execute(const TaskRef& task, int64_t wait) {
+        // the accounting goes to the shard the task was queued on, it may have been stolen
+        ThreadManager::Impl* owner = task->getOwner();
+
+        bool timedOut = task->getExpireTime() && task->getExpireTime() < Util::coarseTime();
+        if (!timedOut && task->waiting() && owner->shed(wait)) {
+            // in LIFO order this task is one of the freshest, the oldest one goes instead
+            timedOut = !(owner->codelLifo_ && owner->dropOldest());
+        }
 
-            while (active && manager_->tasks_.empty()) {
-                manager_->idleCount_++;
-                manager_->monitor_.wait();
-                active = isActive();
-                manager_->idleCount_--;
+        // If the state is changed to anything other than EXECUTING or TIMEDOUT here
+        // then the execution loop needs to be changed below.
+        if (!task->claim(timedOut ? ThreadManager::Task::TIMEDOUT : ThreadManager::Task::EXECUTING)) {
+            // expired or removed while queued, already accounted for
+            owner->removedCount_--;
+            return;
+        }
+
+        if (task->executing()) {
+            try {
+                task->run();
+            } catch (const std::exception& e) {
+                //GlobalOutput.printf("[ERROR] task->run() raised an exception: %s", e.what());
+                LOG_CXX(LOG_ERROR) << "task->run() raised an exception:" << e.what();
+            } catch (...) {
+                //GlobalOutput.printf("[ERROR] task->run() raised an unknown exception");
+                LOG_CXX(LOG_ERROR) << "task->run() raised an unknown exception";
+            }
+        } else {
+            // The only other state the task could have been in is TIMEDOUT (see above)
+            owner->expiredCount_++;
+            if (ExpireCallback expireCallback = owner->expireCallback_) {
+                expireCallback(task->takeRunnable());
             }
-            std::shared_ptr<ThreadManager::Task> task;
+        }
+    }
+
+public:
+    void run() {
+        bool active;
+        {
+            Guard g(manager_->mutex_);
+            active = manager_->workerCount_ < manager_->workerMaxCount_;
             if (active) {
-                if (!manager_->tasks_.empty()) {
-                    task = manager_->tasks_.front();
-                    manager_->tasks_.pop_front();
-                    if (task->state_ == ThreadManager::Task::WAITING) {
-                        // If the state is changed to anything other than EXECUTING or TIMEDOUT here
-                        // then the execution loop needs to be changed below.
-                        task->state_ =
-                            (task->getExpireTime() && task->getExpireTime() < Util::currentTime()) ?
-                            ThreadManager::Task::TIMEDOUT :
-                            ThreadManager::Task::EXECUTING;
-                    }
+                if (++manager_->workerCount_ == manager_->workerMaxCount_) {
+                    manager_->workerMonitor_.notify();
                 }
+            }
+        }
+
+        manager_->pinWorker();
+        WorkerContext context(manager_);
+        WorkerContext::current() = &context;
 
-                /* If we have a pending task max and we just dropped below it, wakeup any
-                    thread that might be blocked on add. */
-                if (manager_->pendingTaskCountMax_ != 0
-                        && manager_->tasks_.size() <= manager_->pendingTaskCountMax_ - 1) {
-                    manager_->maxMonitor_.notify();
+        // Tasks are dequeued in batches when the backlog is deep, see batchSize(). The
+        // worker runs its whole batch before it may retire.
+        std::vector<TaskRef> batch;
+        batch.reserve(THREAD_MANAGER_BATCH_MAX);
+        size_t next = 0;
+        while (active) {
+            if (next == batch.size()) {
+                batch.clear();
+                next = 0;
+                manager_->foldQueueWait(context);
+
+                // Fast path, no lock: the worker is not about to retire, no timer is due
+                // and the queue has tasks, or a peer shard has some to steal.
+                ThreadManager::Impl* source = manager_;
+                bool fast = manager_->workerCount_ <= manager_->workerMaxCount_ && !manager_->timersDue();
+                if (!fast || manager_->tasks_.popBatch(batch, manager_->batchSize()) == 0) {
+                    ThreadManager::Impl* victim = fast ? manager_->steal(batch) : NULL;
+                    if (victim) {
+                        source = victim;
+                    } else {
+                        TaskRef task;
+                        active = waitForTask(task);
+                        if (task) {
+                            batch.push_back(std::move(task));
+                        }
+                    }
+                }
+                if (!batch.empty()) {
+                    // no longer pending, still counted by totalTaskCount() until started
+                    manager_->heldCount_.fetch_add(batch.size(), std::memory_order_relaxed);
+                    source->taskDequeued(batch.size());
+                    source->expireTasksIfDue();
                 }
             }
 
             /**
              * Execution - not holding a lock
              */
-            if (task) {
-                if (task->state_ == ThreadManager::Task::EXECUTING) {
-
-                    // Release the lock so we can run the task without blocking the thread manager
-                    manager_->mutex_.unlock();
-
-                    try {
-                        task->run();
-                    } catch (const std::exception& e) {
-                        //GlobalOutput.printf("[ERROR] task->run() raised an exception: %s", e.what());
-                        LOG_CXX(LOG_ERROR) << "task->run() raised an exception:" << e.what();
-                    } catch (...) {
-                        //GlobalOutput.printf("[ERROR] task->run() raised an unknown exception");
-                        LOG_CXX(LOG_ERROR) << "task->run() raised an unknown exception";
-                    }
-
-                    // Re-acquire the lock to proceed in the thread manager
-                    manager_->mutex_.lock();
-
-                } else if (manager_->expireCallback_) {
-                    // The only other state the task could have been in is TIMEDOUT (see above)
-                    manager_->expireCallback_(task->getRunnable());
-                    manager_->expiredCount_++;
-                }
+            if (next < batch.size()) {
+                TaskRef task(std::move(batch[next++]));
+                manager_->heldCount_.fetch_sub(1, std::memory_order_relaxed);
+                execute(task, manager_->accountQueueWait(context, task));
             }
         }
+        manager_->foldQueueWait(context);
+        WorkerContext::current() = NULL;
 
         /**
          * Final accounting for the worker thread that is done working
          */
+        Guard g(manager_->mutex_);
         manager_->deadWorkers_.insert(this->thread());
         if (--manager_->workerCount_ == manager_->workerMaxCount_) {
             manager_->workerMonitor_.notify();
@@ -293,7 +1482,6 @@ void ThreadManager::Impl::addWorker(size_t value) {
         ThreadManager::Worker *worker = dynamic_cast<ThreadManager::Worker *>((*iter)->runnable());
         worker->state_ = ThreadManager::Worker::STARTING;
         (*iter)->start();
-        idMap_.insert(std::pair<const Thread::id_t, Thread*>((*iter)->getId(), *iter));
     }
 
     while (workerCount_ != workerMaxCount_) {
@@ -307,127 +1495,538 @@ void ThreadManager::Impl::start() {
         return;
     }
 
-    if (state_ == ThreadManager::UNINITIALIZED) {
-        if (!threadFactory_) {
-            //throw InvalidArgumentException();
-            LOG_CXX(LOG_ERROR) << "threadFactory is nullptr";
-            return;
+    if (state_ == ThreadManager::UNINITIALIZED) {
+        if (!threadFactory_) {
+            //throw InvalidArgumentException();
+            LOG_CXX(LOG_ERROR) << "threadFactory is nullptr";
+            return;
+        }
+        state_ = ThreadManager::STARTED;
+        monitor_.notifyAll();
+    }
+
+    while (state_ == STARTING) {
+        monitor_.wait();
+    }
+}
+
+void ThreadManager::Impl::beginStop() {
+    Guard g(mutex_);
+    if (state_ == ThreadManager::STARTED) {
+        state_ = ThreadManager::STOPPING;
+    }
+}
+
+void ThreadManager::Impl::stop() {
+    Guard g(mutex_);
+    bool doStop = false;
+
+    // STOPPING only refused tasks so far, see beginStop()
+    if (state_ != ThreadManager::JOINING &&
+            state_ != ThreadManager::STOPPED) {
+        doStop = true;
+        state_ = ThreadManager::JOINING;
+    }
+
+    if (doStop) {
+        removeWorkersUnderLock(workerCount_);
+        timers_.clear();
+        updateNextTimer();
+
+        Guard e(expireMutex_);
+        expiring_.clear();
+        nextExpire_ = INT64_MAX;
+    }
+
+    state_ = ThreadManager::STOPPED;
+}
+
+void ThreadManager::Impl::removeWorker(size_t value) {
+    Guard g(mutex_);
+    removeWorkersUnderLock(value);
+}
+
+void ThreadManager::Impl::removeWorkersUnderLock(size_t value) {
+    if (value > workerMaxCount_) {
+        //throw InvalidArgumentException();
+        LOG_CXX(LOG_ERROR) << "Invalid Argument";
+        return ;
+    }
+
+    workerMaxCount_ -= value;
+
+    if (idleCount_ > value) {
+        // There are more idle workers than we need to remove,
+        // so notify enough of them so they can terminate.
+        for (size_t ix = 0; ix < value; ix++) {
+            monitor_.notify();
+        }
+    } else {
+        // There are as many or less idle workers than we need to remove,
+        // so just notify them all so they can terminate.
+        monitor_.notifyAll();
+    }
+
+    while (workerCount_ != workerMaxCount_) {
+        workerMonitor_.wait();
+    }
+
+    for (std::set<Thread *>::iterator ix = deadWorkers_.begin(); ix != deadWorkers_.end(); ++ix) {
+
+        // when used with a joinable thread factory, we join the threads as we remove them
+        if (!threadFactory_->isDetached()) {
+            (*ix)->join();
+        }
+
+        workers_.erase(*ix);
+    }
+
+    deadWorkers_.clear();
+}
+
+bool ThreadManager::Impl::canSleep() const {
+    // a shard blocking on another could close a cycle, they count as one manager
+    WorkerContext* context = WorkerContext::current();
+    return !context || (context->manager_ != this && (!group_ || context->manager_->group_ != group_));
+}
+
+TaskHandle ThreadManager::Impl::addToClass(uint32_t classId, std::shared_ptr<Runnable> value, int64_t timeout, int64_t expiration) {
+    if (state_ != ThreadManager::STARTED) {
+        LOG_CXX(LOG_ERROR) << "ThreadManager::Impl::add ThreadManager not started";
+        return TaskHandle();
+    }
+
+    TaskRef task = newTask(expiration);
+    if (!task) {
+        return TaskHandle();
+    }
+    task->runnable_ = value;
+    return enqueue(classId, task, timeout);
+}
+
+TaskHandle ThreadManager::Impl::submitToClass(uint32_t classId, TaskFunction&& value, int64_t timeout, int64_t expiration) {
+    if (state_ != ThreadManager::STARTED) {
+        LOG_CXX(LOG_ERROR) << "ThreadManager::Impl::submit ThreadManager not started";
+        return TaskHandle();
+    }
+
+    TaskRef task = newTask(expiration);
+    if (!task) {
+        return TaskHandle();
+    }
+    task->function_ = std::move(value);
+    return enqueue(classId, task, timeout);
+}
+
+TaskRef ThreadManager::Impl::newTask(int64_t expiration) {
+    TaskRef task(TaskPool::instance().acquire(this));
+    if (task) {
+        task->queueTime_ = Util::tscTimeNsec();
+        if (expiration != 0LL) {
+            task->expireTime_ = Util::coarseTime() + expiration;
+        }
+    }
+    return task;
+}
+
+TaskHandle ThreadManager::Impl::enqueue(uint32_t classId, const TaskRef& task, int64_t timeout) {
+    for (;;) {
+        // tasks expired or removed in place still take a slot until a worker drops them
+        size_t max = pendingTaskCountMax_;
+        int64_t removed = removedCount_;
+        if (tasks_.push(classId, task, max > 0 && removed > 0 ? max + removed : max)) {
+            break;
+        }
+        if (!waitForRoom(timeout)) {
+            return TaskHandle();
+        }
+    }
+    TaskHandle handle(task->getId());
+    if (task->getExpireTime() != 0LL) {
+        indexExpiration(&task, 1);
+    }
+    tasksQueued(1);
+    return handle;
+}
+
+size_t ThreadManager::Impl::addBatch(const std::vector<std::shared_ptr<Runnable> >& tasks, int64_t timeout,
+                                     int64_t expiration, std::vector<TaskHandle>* handles) {
+    if (state_ != ThreadManager::STARTED) {
+        LOG_CXX(LOG_ERROR) << "ThreadManager::Impl::addBatch ThreadManager not started";
+        return 0;
+    }
+
+    std::vector<TaskRef> batch;
+    batch.reserve(tasks.size());
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        TaskRef task = newTask(expiration);
+        if (!task) {
+            break;
+        }
+        task->runnable_ = tasks[i];
+        batch.push_back(std::move(task));
+    }
+
+    // as many tasks as there is room for go at once, the producer only waits for
+    // room when the queue fills up in the middle of the batch
+    size_t added = 0;
+    while (added < batch.size()) {
+        size_t max = pendingTaskCountMax_;
+        int64_t removed = removedCount_;
+        size_t pushed = tasks_.pushBatch(0, &batch[added], batch.size() - added,
+                                         max > 0 && removed > 0 ? max + removed : max);
+        if (pushed == 0) {
+            if (!waitForRoom(timeout)) {
+                break;
+            }
+            continue;
+        }
+        if (expiration != 0LL) {
+            indexExpiration(&batch[added], pushed);
+        }
+        added += pushed;
+        tasksQueued(pushed);
+    }
+
+    if (handles) {
+        for (size_t i = 0; i < added; ++i) {
+            handles->push_back(TaskHandle(batch[i]->getId()));
+        }
+    }
+    return added;
+}
+
+void ThreadManager::Impl::tasksQueued(size_t count) {
+    // If idle thread is available notify it, otherwise all worker threads are
+    // running and will get around to this task in time. The idle worker may not
+    // be waiting yet, mutex_ keeps the notification from slipping in before it does.
+    if (idleCount_ > 0) {
+        Guard g(mutex_);
+        for (size_t idle = idleCount_; count > 0 && idle > 0; --count, --idle) {
+            monitor_.notify();
+        }
+    } else if (!peers_.empty() && tasks_.size() > workerCount_) {
+        wakeThief();
+    }
+}
+
+void ThreadManager::Impl::pinWorker() {
+    if (cpu_ < 0) {
+        return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu_, &set);
+    int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (rc != 0) {
+        LOG_C(LOG_WARNING, "cannot pin worker of shard %lu to cpu %d: %d", shard_, cpu_, rc);
+    }
+}
+
+bool ThreadManager::Impl::stealable() const {
+    for (size_t i = 1; i < peers_.size(); ++i) {
+        const ThreadManager::Impl* peer = peers_[(shard_ + i) % peers_.size()];
+        if (peer->idleCount_ == 0 && !peer->tasks_.empty()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+ThreadManager::Impl* ThreadManager::Impl::steal(std::vector<TaskRef>& batch) {
+    for (size_t i = 1; i < peers_.size(); ++i) {
+        ThreadManager::Impl* peer = peers_[(shard_ + i) % peers_.size()];
+        if (peer->idleCount_ > 0) {
+            continue;
+        }
+        size_t half = (peer->tasks_.size() + 1) / 2;
+        if (half > 0 && peer->tasks_.popBatch(batch, std::min<size_t>(half, THREAD_MANAGER_BATCH_MAX)) > 0) {
+            // still more than its workers can take, pass it on to the next thief
+            if (peer->tasks_.size() > peer->workerCount_) {
+                peer->wakeThief();
+            }
+            return peer;
+        }
+    }
+    return NULL;
+}
+
+void ThreadManager::Impl::wakeThief() {
+    for (size_t i = 1; i < peers_.size(); ++i) {
+        ThreadManager::Impl* peer = peers_[(shard_ + i) % peers_.size()];
+        if (peer->idleCount_ > 0) {
+            Guard g(peer->mutex_);
+            peer->monitor_.notify();
+            return;
+        }
+    }
+}
+
+bool ThreadManager::Impl::remove(TaskHandle handle) {
+    ThreadManager::Task* task = TaskPool::instance().find(handle.id());
+    if (!task || task->owner(handle.id()) != this
+            || !task->transit(handle.id(), ThreadManager::Task::WAITING, ThreadManager::Task::REMOVED)) {
+        return false;
+    }
+    // left in tasks_ as a tombstone, the worker dequeuing it drops it
+    removedCount_++;
+    taskDequeued();
+    return true;
+}
+
+bool ThreadManager::Impl::waitForRoom(int64_t timeout) {
+    // the whole call, locking included, takes at most timeout
+    int64_t deadline = timeout > 0 ? Util::monotonicTime() + timeout : 0;
+    Guard g(mutex_, timeout);
+
+    if (!g) {
+        //throw TimedOutException();
+        LOG_C(LOG_ERROR, "add task is timeout:%ld", timeout);
+        return false;
+    }
+
+    // if we're at a limit, expire tasks to see if the limit clears
+    if (expireTasks(true) > 1) {
+        maxMonitor_.notifyAll();    // room for the other producers too
+    }
+
+    if (pendingTaskCountMax_ > 0 && (pendingTasks() >= pendingTaskCountMax_)) {
+        if (canSleep() && timeout >= 0) {
+            // counted before checking the queue again, see taskDequeued()
+            maxWaiters_++;
+            while (pendingTaskCountMax_ > 0 && pendingTasks() >= pendingTaskCountMax_) {
+                // This is thread safe because the mutex is shared between monitors.
+                int64_t remaining = 0;
+                if (deadline > 0) {
+                    remaining = deadline - Util::monotonicTime();
+                    if (remaining <= 0) {
+                        maxWaiters_--;
+                        LOG_C(LOG_ERROR, "add task is timeout:%ld", timeout);
+                        return false;
+                    }
+                }
+                int64_t next = nextExpire_;
+                int64_t untilExpired = next != INT64_MAX ? std::max<int64_t>(next - Util::coarseTime() + 1, 1) : 0;
+                if (untilExpired > 0 && (remaining == 0 || untilExpired < remaining)) {
+                    // wake up when the earliest pending task expires, that frees a slot too
+                    maxMonitor_.waitForTimeRelative(untilExpired);
+                    if (expireTasks(true) > 1) {
+                        maxMonitor_.notifyAll();
+                    }
+                } else if (maxMonitor_.waitForTimeRelative(remaining) == ETIMEDOUT) {
+                    //throw TimedOutException();
+                    maxWaiters_--;
+                    LOG_C(LOG_ERROR, "add task is timeout:%ld", timeout);
+                    return false;
+                }
+            }
+            maxWaiters_--;
+        } else {
+            //throw TooManyPendingTasksException();
+            LOG_CXX(LOG_ERROR) << "Too Many Pending Tasks Exception";
+            return false;
+        }
+    }
+    return true;
+}
+
+void ThreadManager::Impl::taskDequeued(size_t count) {
+    /* If we have a pending task max and we just dropped below it, wakeup any
+        thread that might be blocked on add. */
+    if (maxWaiters_ > 0 && pendingTaskCountMax_ != 0
+            && pendingTasks() <= pendingTaskCountMax_ - 1) {
+        Guard g(mutex_);
+        if (count > 1) {
+            maxMonitor_.notifyAll();
+        } else {
+            maxMonitor_.notify();
+        }
+    }
+}
+
+int64_t ThreadManager::Impl::accountQueueWait(WorkerContext& context, const TaskRef& task) {
+    int64_t wait = Util::tscTimeNsec() - task->getQueueTime();
+    if (wait > 0) {
+        context.queueWait_ += wait;
+    }
+    context.dequeued_++;
+    return wait;
+}
+
+bool ThreadManager::Impl::shed(int64_t wait) {
+    int64_t target = codelTarget_.load(std::memory_order_relaxed);
+    if (target == 0 || (wait < target && !codelArmed_.load(std::memory_order_relaxed))) {
+        return false;
+    }
+    // Another worker is running the state machine, this task goes through. Losing a
+    // sample now and then only delays the reaction a little.
+    Guard g(codelMutex_, -1);
+    if (!g) {
+        return false;
+    }
+
+    int64_t now = Util::tscTimeNsec();
+    int64_t interval = codelInterval_;
+    bool standing = tasks_.size() > workerCount_;
+    // In LIFO order the tasks dequeued are the freshest, their wait says nothing about
+    // the backlog: once dropping, only its draining ends the overload.
+    bool below = codelLifo_ && dropping_ ? !standing : (wait < target || !standing);
+    bool okToDrop = false;
+    if (below) {
+        // under target, or the queue drains as fast as the workers get to it
+        firstAbove_ = 0;
+    } else if (firstAbove_ == 0) {
+        firstAbove_ = now + interval;
+    } else if (now >= firstAbove_) {
+        // above target for a whole interval: the minimum wait over it was too
+        okToDrop = true;
+    }
+
+    bool drop = false;
+    if (dropping_) {
+        if (!okToDrop) {
+            overloaded(false);
+        } else if (now >= dropNext_) {
+            drop = true;
+            ++dropCount_;
+            dropNext_ += (int64_t)(interval / std::sqrt((double)dropCount_));
         }
-        state_ = ThreadManager::STARTED;
-        monitor_.notifyAll();
+    } else if (okToDrop) {
+        drop = true;
+        // back to dropping soon after it stopped: resume near the rate it had reached
+        dropCount_ = dropCount_ > 2 && now - dropNext_ < 16 * interval ? dropCount_ - 2 : 1;
+        dropNext_ = now + (int64_t)(interval / std::sqrt((double)dropCount_));
+        overloaded(true);
     }
+    codelArmed_.store(firstAbove_ != 0 || dropping_, std::memory_order_relaxed);
+    return drop;
+}
 
-    while (state_ == STARTING) {
-        monitor_.wait();
+void ThreadManager::Impl::overloaded(bool value) {
+    dropping_ = value;
+    if (codelLifo_) {
+        tasks_.lifo(value);
     }
 }
 
-void ThreadManager::Impl::stop() {
-    Guard g(mutex_);
-    bool doStop = false;
+bool ThreadManager::Impl::dropOldest() {
+    TaskRef task;
+    while (tasks_.popOldest(task)) {
+        if (task->claim(ThreadManager::Task::TIMEDOUT)) {
+            expiredCount_++;
+            if (ExpireCallback expireCallback = expireCallback_) {
+                expireCallback(task->takeRunnable());
+            }
+            taskDequeued();
+            return true;
+        }
+        // expired or removed while queued, already accounted for
+        removedCount_--;
+    }
+    return false;
+}
 
-    if (state_ != ThreadManager::STOPPING &&
-            state_ != ThreadManager::JOINING &&
-            state_ != ThreadManager::STOPPED) {
-        doStop = true;
-        state_ = ThreadManager::JOINING;
+void ThreadManager::Impl::setControlledDelay(int64_t target, int64_t interval, bool lifo) {
+    if (target < 0 || interval <= 0) {
+        LOG_C(LOG_ERROR, "invalid controlled delay target:%ld interval:%ld", target, interval);
+        return;
     }
+    Guard g(codelMutex_);
+    codelTarget_ = target * 1000;
+    codelInterval_ = interval * 1000;
+    codelLifo_ = lifo;
+    firstAbove_ = 0;
+    dropCount_ = 0;
+    overloaded(false);
+    tasks_.lifo(false);
+    codelArmed_ = false;
+}
 
-    if (doStop) {
-        removeWorkersUnderLock(workerCount_);
+void ThreadManager::Impl::foldQueueWait(WorkerContext& context) {
+    if (context.dequeued_ == 0) {
+        return;
     }
+    queueWaitTime_.fetch_add(context.queueWait_, std::memory_order_relaxed);
+    dequeuedCount_.fetch_add(context.dequeued_, std::memory_order_relaxed);
+    context.queueWait_ = 0;
+    context.dequeued_ = 0;
+}
 
-    state_ = ThreadManager::STOPPED;
+size_t ThreadManager::Impl::batchSize() const {
+    size_t workers = workerCount_;
+    if (idleCount_ > 0 || workers == 0) {
+        return 1;
+    }
+    size_t size = tasks_.size() / workers;
+    return size < 1 ? 1 : (size > THREAD_MANAGER_BATCH_MAX ? THREAD_MANAGER_BATCH_MAX : size);
 }
 
-void ThreadManager::Impl::removeWorker(size_t value) {
-    Guard g(mutex_);
-    removeWorkersUnderLock(value);
+TimerHandle ThreadManager::Impl::scheduleEvery(std::shared_ptr<Runnable> task, int64_t period) {
+    if (period <= 0) {
+        LOG_C(LOG_ERROR, "invalid schedule period:%ld", period);
+        return TimerHandle();
+    }
+    return schedule(task, period, period);
 }
 
-void ThreadManager::Impl::removeWorkersUnderLock(size_t value) {
-    if (value > workerMaxCount_) {
-        //throw InvalidArgumentException();
-        LOG_CXX(LOG_ERROR) << "Invalid Argument";
-        return ;
+TimerHandle ThreadManager::Impl::schedule(std::shared_ptr<Runnable> task, int64_t delay, int64_t period) {
+    Guard g(mutex_);
+    if (state_ != ThreadManager::STARTED) {
+        LOG_CXX(LOG_ERROR) << "ThreadManager::Impl::schedule ThreadManager not started";
+        return TimerHandle();
     }
 
-    workerMaxCount_ -= value;
+    TimerQueue::TimePoint when = TimerQueue::Clock::now() + std::chrono::milliseconds(delay > 0 ? delay : 0);
+    bool earliest = timers_.empty() || when < timers_.next();
+    TimerHandle handle = timers_.push(when, task, std::chrono::milliseconds(period));
+    updateNextTimer();
 
-    if (idleCount_ > value) {
-        // There are more idle workers than we need to remove,
-        // so notify enough of them so they can terminate.
-        for (size_t ix = 0; ix < value; ix++) {
-            monitor_.notify();
-        }
-    } else {
-        // There are as many or less idle workers than we need to remove,
-        // so just notify them all so they can terminate.
+    // the earliest deadline moved, let the worker watching the timers recompute it
+    if (earliest && idleCount_ > 0) {
         monitor_.notifyAll();
     }
+    return handle;
+}
 
-    while (workerCount_ != workerMaxCount_) {
-        workerMonitor_.wait();
+size_t ThreadManager::Impl::promoteTimers() {
+    if (timers_.empty()) {
+        return 0;
     }
 
-    for (std::set<Thread *>::iterator ix = deadWorkers_.begin(); ix != deadWorkers_.end(); ++ix) {
-
-        // when used with a joinable thread factory, we join the threads as we remove them
-        if (!threadFactory_->isDetached()) {
-            (*ix)->join();
+    size_t promoted = timers_.popDue(TimerQueue::Clock::now(), [this](const std::shared_ptr<Runnable>& runnable) {
+        TaskRef task = newTask(0LL);
+        if (task) {
+            task->runnable_ = runnable;
+            tasks_.push(0, task);
         }
-
-        idMap_.erase((*ix)->getId());
-        workers_.erase(*ix);
-    }
-
-    deadWorkers_.clear();
+    });
+    updateNextTimer();
+    return promoted;
 }
 
-bool ThreadManager::Impl::canSleep() const {
-    const Thread::id_t id = threadFactory_->getCurrentThreadId();
-    return idMap_.find(id) == idMap_.end();
+void ThreadManager::Impl::updateNextTimer() {
+    nextTimer_ = timers_.empty() ? INT64_MAX : std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     timers_.next().time_since_epoch()).count();
 }
 
-void ThreadManager::Impl::add(std::shared_ptr<Runnable> value, int64_t timeout, int64_t expiration) {
-    Guard g(mutex_, timeout);
-
-    if (!g) {
-        //throw TimedOutException();
-        LOG_C(LOG_ERROR, "add task is timeout:%ld", timeout);
-        return;
-    }
+bool ThreadManager::Impl::timersDue() const {
+    int64_t next = nextTimer_.load(std::memory_order_relaxed);
+    // steady_clock is CLOCK_MONOTONIC, which the TSC clock is calibrated against
+    return next != INT64_MAX && next <= Util::tscTimeNsec();
+}
 
-    if (state_ != ThreadManager::STARTED) {
-        LOG_CXX(LOG_ERROR) << "ThreadManager::Impl::add ThreadManager not started";
+void ThreadManager::Impl::waitForWork() {
+    if (timers_.empty() || timerWaiter_) {
+        monitor_.wait();
         return;
     }
 
-    // if we're at a limit, remove an expired task to see if the limit clears
-    if (pendingTaskCountMax_ > 0 && (tasks_.size() >= pendingTaskCountMax_)) {
-        removeExpired(true);
-    }
-
-    if (pendingTaskCountMax_ > 0 && (tasks_.size() >= pendingTaskCountMax_)) {
-        if (canSleep() && timeout >= 0) {
-            while (pendingTaskCountMax_ > 0 && tasks_.size() >= pendingTaskCountMax_) {
-                // This is thread safe because the mutex is shared between monitors.
-                maxMonitor_.wait(timeout);
-            }
-        } else {
-            //throw TooManyPendingTasksException();
-            LOG_CXX(LOG_ERROR) << "Too Many Pending Tasks Exception";
-            return;
-        }
-    }
-
-    tasks_.push_back(std::shared_ptr<ThreadManager::Task>(new ThreadManager::Task(value, expiration)));
+    TimerQueue::Duration delay = timers_.next() - TimerQueue::Clock::now();
+    int64_t timeout = std::chrono::duration_cast<std::chrono::milliseconds>(delay).count() + 1;
 
-    // If idle thread is available notify it, otherwise all worker threads are
-    // running and will get around to this task in time.
-    if (idleCount_ > 0) {
-        monitor_.notify();
-    }
+    timerWaiter_ = true;
+    monitor_.waitForTimeRelative(timeout > 0 ? timeout : 1);
+    timerWaiter_ = false;
 }
 
 void ThreadManager::Impl::remove(std::shared_ptr<Runnable> task) {
@@ -440,12 +2039,9 @@ void ThreadManager::Impl::remove(std::shared_ptr<Runnable> task) {
         return;
     }
 
-    for (TaskQueue::iterator it = tasks_.begin(); it != tasks_.end(); ++it) {
-        if ((*it)->getRunnable() == task) {
-            tasks_.erase(it);
-            return;
-        }
-    }
+    tasks_.eraseIf([&task](const TaskRef& pending) {
+        return task && pending->getRunnable() == task && pending->claim(ThreadManager::Task::REMOVED);
+    }, true);
 }
 
 std::shared_ptr<Runnable> ThreadManager::Impl::removeNextPending() {
@@ -455,42 +2051,87 @@ std::shared_ptr<Runnable> ThreadManager::Impl::removeNextPending() {
         return NULL;
     }
 
-    if (tasks_.empty()) {
-        return NULL;
+    TaskRef task;
+    while (tasks_.pop(task)) {
+        if (task->claim(ThreadManager::Task::REMOVED)) {
+            return task->takeRunnable();
+        }
+        removedCount_--;
     }
+    return NULL;
+}
 
-    std::shared_ptr<ThreadManager::Task> task = tasks_.front();
-    tasks_.pop_front();
-
-    return task->getRunnable();
+size_t ThreadManager::Impl::pendingTasks() const {
+    size_t size = tasks_.size();
+    int64_t removed = removedCount_;
+    if (removed <= 0) {
+        return size;
+    }
+    return size > (size_t)removed ? size - removed : 0;
 }
 
-void ThreadManager::Impl::removeExpired(bool justOne) {
-    // this is always called under a lock
-    int64_t now = 0LL;
+void ThreadManager::Impl::indexExpiration(const TaskRef* tasks, size_t count) {
+    Guard g(expireMutex_);
+    if (expiring_.size() > 64 && expiring_.size() > 2 * pendingTasks()) {
+        expiring_.erase(std::remove_if(expiring_.begin(), expiring_.end(), [](const Expiring& e) {
+            return !e.second->waiting();
+        }), expiring_.end());
+        std::make_heap(expiring_.begin(), expiring_.end(), LaterExpiring());
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        expiring_.push_back(Expiring(tasks[i]->getExpireTime(), tasks[i]));
+        std::push_heap(expiring_.begin(), expiring_.end(), LaterExpiring());
+    }
+    nextExpire_ = expiring_.front().first;
+}
 
-    for (TaskQueue::iterator it = tasks_.begin(); it != tasks_.end(); ) {
-        if (now == 0LL) {
-            now = Util::currentTime();
+size_t ThreadManager::Impl::expireTasks(bool wait) {
+    std::vector<std::shared_ptr<Runnable> > expired;
+    size_t count = 0;
+    {
+        Guard g(expireMutex_, wait ? 0 : -1);
+        if (!g) {
+            return 0;
         }
 
-        if ((*it)->getExpireTime() > 0LL && (*it)->getExpireTime() < now) {
-            if (expireCallback_) {
-                expireCallback_((*it)->getRunnable());
-            }
-            it = tasks_.erase(it);
-            ++expiredCount_;
-            if (justOne) {
-                return;
+        int64_t now = Util::coarseTime();
+        while (!expiring_.empty() && expiring_.front().first < now) {
+            std::pop_heap(expiring_.begin(), expiring_.end(), LaterExpiring());
+            TaskRef task = expiring_.back().second;
+            expiring_.pop_back();
+            if (task->claim(ThreadManager::Task::REMOVED)) {
+                removedCount_++;
+                expiredCount_++;
+                count++;
+                if (expireCallback_.load()) {
+                    expired.push_back(task->takeRunnable());
+                }
             }
-        } else {
-            ++it;
+        }
+        nextExpire_ = expiring_.empty() ? INT64_MAX : expiring_.front().first;
+    }
+
+    // outside of expireMutex_, the callback may add tasks
+    if (ExpireCallback expireCallback = expireCallback_) {
+        for (size_t i = 0; i < expired.size(); ++i) {
+            expireCallback(expired[i]);
+        }
+    }
+    return count;
+}
+
+void ThreadManager::Impl::expireTasksIfDue() {
+    int64_t next = nextExpire_.load(std::memory_order_relaxed);
+    if (next != INT64_MAX && next < Util::coarseTime()) {
+        size_t expired = expireTasks(false);
+        if (expired > 0) {
+            taskDequeued(expired);
         }
     }
 }
 
 void ThreadManager::Impl::setExpireCallback(ExpireCallback expireCallback) {
-    Guard g(mutex_);
     expireCallback_ = expireCallback;
 }
 
@@ -518,3 +2159,323 @@ ThreadManager *ThreadManager::noblockingTaskThreadManager() {
 ThreadManager *ThreadManager::blockingTaskThreadManager(size_t count, size_t pendingTaskCountMax) {
     return  new SimpleThreadManager(count, pendingTaskCountMax);
 }
+
+/**
+ * ShardedThreadManager over one ThreadManager::Impl per shard. The shards know
+ * each other as peers_, which is what their workers steal from.
+ */
+class PerCoreThreadManager : public ShardedThreadManager {
+public:
+    PerCoreThreadManager(size_t shards, size_t workersPerShard, size_t pendingTaskCountMax, bool pinned)
+        : workersPerShard_(workersPerShard)
+        , pendingTaskCountMax_(pendingTaskCountMax)
+        , next_(0) {
+        std::vector<int> cpus;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+                if (CPU_ISSET(cpu, &set)) {
+                    cpus.push_back(cpu);
+                }
+            }
+        }
+        if (shards == 0) {
+            shards = cpus.empty() ? 1 : cpus.size();
+        }
+
+        for (size_t i = 0; i < shards; ++i) {
+            shards_.push_back(new ThreadManager::Impl());
+        }
+        for (size_t i = 0; i < shards; ++i) {
+            ThreadManager::Impl* shard = shards_[i];
+            shard->group_ = this;
+            shard->shard_ = i;
+            shard->cpu_ = pinned && !cpus.empty() ? cpus[i % cpus.size()] : -1;
+            if (shards > 1) {
+                shard->peers_ = shards_;
+            }
+        }
+
+        // a CPU without a shard of its own shares one with the others
+        if (!cpus.empty()) {
+            cpuShards_.assign(cpus.back() + 1, 0);
+            for (size_t i = 0; i < cpus.size(); ++i) {
+                cpuShards_[cpus[i]] = i % shards;
+            }
+        }
+    }
+
+    ~PerCoreThreadManager() {
+        stop();
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            delete shards_[i];
+        }
+    }
+
+public:
+    virtual void start() {
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            shards_[i]->pendingTaskCountMax(pendingTaskCountMax_);
+            shards_[i]->start();
+        }
+        // only once, calling start() again adds no worker
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            if (shards_[i]->state() == ThreadManager::STARTED && shards_[i]->workerCount() == 0) {
+                shards_[i]->addWorker(workersPerShard_);
+            }
+        }
+    }
+
+    virtual void stop() {
+        // every shard stops taking tasks before any of them is joined, so the
+        // shards still running do not keep taking what the joined ones refuse
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            shards_[i]->beginStop();
+        }
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            shards_[i]->stop();
+        }
+    }
+
+    virtual ThreadManager::STATE state() const {
+        return shards_[0]->state();
+    }
+
+    virtual std::shared_ptr<ThreadFactory> threadFactory() {
+        return shards_[0]->threadFactory();
+    }
+
+    virtual void threadFactory(std::shared_ptr<ThreadFactory> value) {
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            shards_[i]->threadFactory(value);
+        }
+    }
+
+    virtual void addWorker(size_t value) {
+        // to the shards with the fewest workers first
+        std::vector<size_t> counts = workerCounts();
+        std::vector<size_t> added(shards_.size(), 0);
+        for (; value > 0; --value) {
+            size_t min = std::min_element(counts.begin(), counts.end()) - counts.begin();
+            counts[min]++;
+            added[min]++;
+        }
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            if (added[i] > 0) {
+                shards_[i]->addWorker(added[i]);
+            }
+        }
+    }
+
+    virtual void removeWorker(size_t value) {
+        // from the shards with the most workers first
+        std::vector<size_t> counts = workerCounts();
+        std::vector<size_t> removed(shards_.size(), 0);
+        for (; value > 0; --value) {
+            size_t max = std::max_element(counts.begin(), counts.end()) - counts.begin();
+            if (counts[max] == 0) {
+                LOG_CXX(LOG_ERROR) << "Invalid Argument";
+                break;
+            }
+            counts[max]--;
+            removed[max]++;
+        }
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            if (removed[i] > 0) {
+                shards_[i]->removeWorker(removed[i]);
+            }
+        }
+    }
+
+    virtual size_t idleWorkerCount() const {
+        size_t count = 0;
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            count += shards_[i]->idleWorkerCount();
+        }
+        return count;
+    }
+
+    virtual size_t workerCount() {
+        return sum(&ThreadManager::workerCount);
+    }
+
+    virtual size_t pendingTaskCount() {
+        return sum(&ThreadManager::pendingTaskCount);
+    }
+
+    virtual size_t totalTaskCount() {
+        return sum(&ThreadManager::totalTaskCount);
+    }
+
+    virtual size_t pendingTaskCountMax() {
+        return pendingTaskCountMax_ * shards_.size();
+    }
+
+    virtual size_t expiredTaskCount() {
+        return sum(&ThreadManager::expiredTaskCount);
+    }
+
+    virtual uint64_t queueWaitTime() {
+        return sum(&ThreadManager::queueWaitTime);
+    }
+
+    virtual uint64_t dequeuedTaskCount() {
+        return sum(&ThreadManager::dequeuedTaskCount);
+    }
+
+    virtual TaskHandle add(std::shared_ptr<Runnable> task, int64_t timeout, int64_t expiration) {
+        return shards_[currentShard()]->add(task, timeout, expiration);
+    }
+
+    virtual TaskHandle addToClass(uint32_t classId, std::shared_ptr<Runnable> task, int64_t timeout, int64_t expiration) {
+        return shards_[currentShard()]->addToClass(classId, task, timeout, expiration);
+    }
+
+    virtual size_t addBatch(const std::vector<std::shared_ptr<Runnable> >& tasks, int64_t timeout,
+                            int64_t expiration, std::vector<TaskHandle>* handles) {
+        return shards_[currentShard()]->addBatch(tasks, timeout, expiration, handles);
+    }
+
+    virtual TaskHandle submitToClass(uint32_t classId, TaskFunction&& task, int64_t timeout, int64_t expiration) {
+        return shards_[currentShard()]->submitToClass(classId, std::move(task), timeout, expiration);
+    }
+
+    virtual void setClassWeight(uint32_t classId, uint32_t weight) {
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            shards_[i]->setClassWeight(classId, weight);
+        }
+    }
+
+    virtual TimerHandle scheduleAfter(std::shared_ptr<Runnable> task, int64_t delay) {
+        return shards_[currentShard()]->scheduleAfter(task, delay);
+    }
+
+    virtual TimerHandle scheduleAt(std::shared_ptr<Runnable> task, int64_t time) {
+        return shards_[currentShard()]->scheduleAt(task, time);
+    }
+
+    virtual TimerHandle scheduleEvery(std::shared_ptr<Runnable> task, int64_t period) {
+        return shards_[currentShard()]->scheduleEvery(task, period);
+    }
+
+    virtual void remove(std::shared_ptr<Runnable> task) {
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            shards_[i]->remove(task);
+        }
+    }
+
+    virtual bool remove(TaskHandle handle) {
+        // only the shard that queued the task matches the handle
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            if (shards_[i]->remove(handle)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    virtual std::shared_ptr<Runnable> removeNextPending() {
+        size_t local = currentShard();
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            std::shared_ptr<Runnable> task = shards_[(local + i) % shards_.size()]->removeNextPending();
+            if (task) {
+                return task;
+            }
+        }
+        return NULL;
+    }
+
+    virtual void removeExpiredTasks() {
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            shards_[i]->removeExpiredTasks();
+        }
+    }
+
+    virtual void setExpireCallback(ExpireCallback expireCallback) {
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            shards_[i]->setExpireCallback(expireCallback);
+        }
+    }
+
+    virtual void setControlledDelay(int64_t target, int64_t interval, bool lifo) {
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            shards_[i]->setControlledDelay(target, interval, lifo);
+        }
+    }
+
+    virtual size_t shardCount() const {
+        return shards_.size();
+    }
+
+    virtual size_t currentShard() const {
+        WorkerContext* context = WorkerContext::current();
+        if (context && context->manager_->group_ == this) {
+            return context->manager_->shard_;
+        }
+        int cpu = sched_getcpu();
+        if (cpu >= 0 && (size_t)cpu < cpuShards_.size()) {
+            return cpuShards_[cpu];
+        }
+        return next_.fetch_add(1, std::memory_order_relaxed) % shards_.size();
+    }
+
+    virtual ThreadManager* shard(size_t index) {
+        return index < shards_.size() ? shards_[index] : NULL;
+    }
+
+    virtual TaskHandle addToShard(size_t shard, std::shared_ptr<Runnable> task, int64_t timeout, int64_t expiration) {
+        if (shard >= shards_.size()) {
+            LOG_C(LOG_ERROR, "no shard %lu of %lu", shard, shards_.size());
+            return TaskHandle();
+        }
+        return shards_[shard]->add(task, timeout, expiration);
+    }
+
+    virtual TaskHandle submitToShard(size_t shard, TaskFunction&& task, int64_t timeout, int64_t expiration) {
+        if (shard >= shards_.size()) {
+            LOG_C(LOG_ERROR, "no shard %lu of %lu", shard, shards_.size());
+            return TaskHandle();
+        }
+        return shards_[shard]->submitToClass(0, std::move(task), timeout, expiration);
+    }
+
+    virtual size_t addBatchToShard(size_t shard, const std::vector<std::shared_ptr<Runnable> >& tasks,
+                                   int64_t timeout, int64_t expiration, std::vector<TaskHandle>* handles) {
+        if (shard >= shards_.size()) {
+            LOG_C(LOG_ERROR, "no shard %lu of %lu", shard, shards_.size());
+            return 0;
+        }
+        return shards_[shard]->addBatch(tasks, timeout, expiration, handles);
+    }
+
+private:
+    std::vector<size_t> workerCounts() {
+        std::vector<size_t> counts;
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            counts.push_back(shards_[i]->workerCount());
+        }
+        return counts;
+    }
+
+    template <class T>
+    T sum(T (ThreadManager::*counter)()) {
+        T total = 0;
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            total += (shards_[i]->*counter)();
+        }
+        return total;
+    }
+
+private:
+    const size_t workersPerShard_;
+    const size_t pendingTaskCountMax_;
+    std::vector<ThreadManager::Impl*> shards_;
+    std::vector<size_t> cpuShards_;             // shard of each CPU, by CPU number
+    mutable std::atomic<size_t> next_;          // round robin for threads whose CPU is unknown
+};
+
+ShardedThreadManager *ThreadManager::shardedThreadManager(size_t shards, size_t workersPerShard,
+                                                          size_t pendingTaskCountMax, bool pinned) {
+    return new PerCoreThreadManager(shards, workersPerShard, pendingTaskCountMax, pinned);
+}
@@ -2,10 +2,43 @@
 #define __CF_THREAD_MANAGER_H
 
 #include <memory>
+#include <stdint.h>
 #include <sys/types.h>
+#include <utility>
+#include <vector>
+#include "TaskFunction.h"
+#include "TimerHeap.h"
 
 class Runnable;
+class ShardedThreadManager;
 class ThreadFactory;
+
+/**
+ * Handle of a task queued on a ThreadManager, returned by add().
+ *
+ * It names a generation-counted slot, so ThreadManager::remove(TaskHandle) finds the
+ * task in O(1), and a handle kept after its task ran or was removed matches nothing.
+ */
+class TaskHandle {
+public:
+    TaskHandle()
+        : id_(0) {}
+    explicit TaskHandle(uint64_t id)
+        : id_(id) {}
+
+public:
+    bool valid() const {
+        return id_ != 0;
+    }
+
+    uint64_t id() const {
+        return id_;
+    }
+
+private:
+    uint64_t id_;       // generation in the high 32 bits, slot index in the low ones
+};
+
 class ThreadManager {
 public:
     typedef void(*ExpireCallback)(std::shared_ptr<Runnable>);
@@ -78,27 +111,121 @@ public:
     */
     virtual size_t expiredTaskCount() = 0;
 
+    /**
+    * Gets the total time in microseconds that tasks spent between add() and a worker
+    * getting to them, for the tasks counted by dequeuedTaskCount().
+    */
+    virtual uint64_t queueWaitTime() = 0;
+
+    /**
+    * Gets the number of tasks the workers got to: run, or dropped as expired or removed.
+    */
+    virtual uint64_t dequeuedTaskCount() = 0;
+
     /**
     * Adds a task to be executed at some time in the future by a worker thread.
     *
     * This method will block if pendingTaskCountMax() in not zero and pendingTaskCount()
     * is greater than or equalt to pendingTaskCountMax().
     *  If this method is called in the context of a ThreadManager worker thread it will throw a
+    *
+    * \returns a handle for remove(TaskHandle), not valid if the task was not added
+    */
+    virtual TaskHandle add(std::shared_ptr<Runnable> task, int64_t timeout = 0LL, int64_t expiration = 0LL) = 0;
+
+    /**
+    * Adds a task on behalf of a task class (tenant), see add(). Tasks added with add()
+    * belong to class 0.
+    *
+    * Every class has its own queue and workers pick the next task by deficit round robin
+    * across the backlogged classes, so a class flooding the manager only delays its own
+    * tasks. pendingTaskCountMax() still applies to the sum of all classes.
+    */
+    virtual TaskHandle addToClass(uint32_t classId, std::shared_ptr<Runnable> task,
+                                  int64_t timeout = 0LL, int64_t expiration = 0LL) = 0;
+
+    /**
+    * Adds tasks at once, see add(). The tasks are queued with as few atomic operations
+    * and lock holds as possible, pendingTaskCountMax() is checked once for as many tasks
+    * as there is room for, and as many idle workers are woken as there are new tasks.
+    *
+    * \param[out] handles  if not NULL, receives the handles of the added tasks
+    * \returns the number of tasks added, the first ones of tasks; fewer than all of
+    *          them if the timeout passed while waiting for room
+    */
+    virtual size_t addBatch(const std::vector<std::shared_ptr<Runnable> >& tasks, int64_t timeout = 0LL,
+                            int64_t expiration = 0LL, std::vector<TaskHandle>* handles = NULL) = 0;
+
+    /**
+    * Adds a callable instead of a Runnable, see add(). Any void() callable works,
+    * move-only ones included.
+    *
+    * Tasks come from a pool with per-thread caches. A callable of up to
+    * TaskFunction::INLINE_SIZE bytes is stored in the pooled task itself, so in
+    * steady state queuing it does not touch the heap.
+    */
+    template <class F>
+    TaskHandle submit(F&& task, int64_t timeout = 0LL, int64_t expiration = 0LL) {
+        return submitToClass(0, TaskFunction(std::forward<F>(task)), timeout, expiration);
+    }
+
+    /**
+    * Adds a callable on behalf of a task class, see submit() and addToClass().
+    */
+    virtual TaskHandle submitToClass(uint32_t classId, TaskFunction&& task,
+                                     int64_t timeout = 0LL, int64_t expiration = 0LL) = 0;
+
+    /**
+    * Sets the weight of a task class, 1 by default. Backlogged classes are served in
+    * proportion to their weights.
+    */
+    virtual void setClassWeight(uint32_t classId, uint32_t weight) = 0;
+
+    /**
+    * Schedules a task to be added to the task queue after delay milliseconds.
+    *
+    * Due tasks are moved straight into the task queue by an idle worker thread, no timer
+    * thread is involved, and they are not subject to pendingTaskCountMax().
+    * The returned handle cancels the task as long as it has not been queued yet.
+    */
+    virtual TimerHandle scheduleAfter(std::shared_ptr<Runnable> task, int64_t delay) = 0;
+
+    /**
+    * Schedules a task at an absolute time given as milliseconds from epoch,
+    * see Util::currentTime().
     */
-    virtual void add(std::shared_ptr<Runnable> task, int64_t timeout = 0LL, int64_t expiration = 0LL) = 0;
+    virtual TimerHandle scheduleAt(std::shared_ptr<Runnable> task, int64_t time) = 0;
 
     /**
-    * Removes a pending task
+    * Schedules a task every period milliseconds at a fixed rate, the first run is one
+    * period from now. The task keeps being queued until the handle is cancelled or the
+    * thread manager is stopped.
+    */
+    virtual TimerHandle scheduleEvery(std::shared_ptr<Runnable> task, int64_t period) = 0;
+
+    /**
+    * Removes a pending task, searching the task queue for it.
     */
     virtual void remove(std::shared_ptr<Runnable> task) = 0;
 
+    /**
+    * Removes the pending task returned by add() in O(1) and without locking. The
+    * task is marked removed and workers drop it when they get to it.
+    * \returns false if the task already started, expired or was removed
+    */
+    virtual bool remove(TaskHandle handle) = 0;
+
     /**
     * Remove the next pending task which would be run.
     */
     virtual std::shared_ptr<Runnable> removeNextPending() = 0;
 
     /**
-    * Remove tasks from front of task queue that have expired.
+    * Remove the pending tasks that have expired.
+    *
+    * Expiring tasks are indexed by expiration time, so this costs O(k log n) for k
+    * expired tasks. Workers also sweep on their own whenever a pending task has
+    * expired, so calling this is not required to reclaim them.
     */
     virtual void removeExpiredTasks() = 0;
 
@@ -107,6 +234,23 @@ public:
     */
     virtual void setExpireCallback(ExpireCallback expireCallback) = 0;
 
+    /**
+    * Turns on controlled delay (CoDel) load shedding, or off with a target of 0.
+    *
+    * Workers look at how long each task waited in the queue. Once the wait stayed
+    * above target for a whole interval, i.e. even its minimum did, the queue is a
+    * standing one and the manager sheds load: it drops a task, then more at a rate
+    * growing with the square root of the drops until the wait gets back under
+    * target. Dropped tasks are expired, they go to the expire callback and count in
+    * expiredTaskCount(). Bursts that drain within an interval lose nothing.
+    *
+    * \param target  queue wait in microseconds, 5000 is a common choice
+    * \param interval  microseconds, about the time a worker takes to react to a drop
+    * \param lifo  while shedding, serve the newest tasks first: they are the ones
+    *              whose callers are still waiting. Applies to tasks of class 0.
+    */
+    virtual void setControlledDelay(int64_t target, int64_t interval = 100000LL, bool lifo = false) = 0;
+
 public:
     /**
     * Creates a simple thread manager the uses count number of worker threads and has
@@ -117,6 +261,17 @@ public:
 
     static ThreadManager *blockingTaskThreadManager(size_t count = 4, size_t pendingTaskCountMax = 0);
 
+    /**
+    * Creates a thread manager made of shards, each with its own task queue, lock and
+    * workersPerShard worker threads, see ShardedThreadManager.
+    *
+    * \param shards  0 for one shard per CPU the process may run on
+    * \param pendingTaskCountMax  maximum pending tasks of each shard, 0 for no limit
+    * \param pinned  whether the workers of a shard are bound to its CPU
+    */
+    static ShardedThreadManager *shardedThreadManager(size_t shards = 0, size_t workersPerShard = 1,
+                                                      size_t pendingTaskCountMax = 0, bool pinned = true);
+
 protected:
     ThreadManager() {};
 
@@ -126,4 +281,62 @@ public:
     class Impl;		//thread impl
 };
 
+/**
+ * Thread-per-core thread manager: one shard per CPU, each a thread manager of its own
+ * whose workers are pinned to that CPU, so producers on different CPUs never contend
+ * on the same queue or mutex.
+ *
+ * add(), submit() and the scheduling calls go to the local shard of the caller: its
+ * own shard on a worker, the shard of the CPU it runs on otherwise. Work is
+ * rebalanced by stealing: a worker that finds its shard empty takes half of the
+ * backlog of a shard whose workers are all busy, and a shard that queues more tasks
+ * than it has workers wakes an idle worker of another shard to come and steal.
+ *
+ * The counters are the sums over the shards, and the ThreadManager calls that
+ * configure the manager apply to every shard; addWorker() and removeWorker() keep
+ * the shards balanced.
+ */
+class ShardedThreadManager : public ThreadManager {
+public:
+    /**
+    * Gets the number of shards.
+    */
+    virtual size_t shardCount() const = 0;
+
+    /**
+    * Gets the shard add() uses from the calling thread.
+    */
+    virtual size_t currentShard() const = 0;
+
+    /**
+    * Gets a shard, e.g. to watch its counters.
+    */
+    virtual ThreadManager* shard(size_t index) = 0;
+
+    /**
+    * Adds a task to the given shard instead of the local one, see add().
+    * \returns an invalid handle if there is no such shard
+    */
+    virtual TaskHandle addToShard(size_t shard, std::shared_ptr<Runnable> task,
+                                  int64_t timeout = 0LL, int64_t expiration = 0LL) = 0;
+
+    /**
+    * Adds a callable to the given shard, see submit().
+    */
+    virtual TaskHandle submitToShard(size_t shard, TaskFunction&& task,
+                                     int64_t timeout = 0LL, int64_t expiration = 0LL) = 0;
+
+    /**
+    * Adds tasks to the given shard at once, see addBatch(). This is how a producer
+    * hands a run of tasks to another shard: the remote queue and its workers are
+    * touched once for the whole batch instead of once per task.
+    */
+    virtual size_t addBatchToShard(size_t shard, const std::vector<std::shared_ptr<Runnable> >& tasks,
+                                   int64_t timeout = 0LL, int64_t expiration = 0LL,
+                                   std::vector<TaskHandle>* handles = NULL) = 0;
+
+protected:
+    ShardedThreadManager() {};
+};
+
 #endif
\ No newline at end of file
@@ -11,6 +11,10 @@ Timer::~Timer() {
 }
 
 void Timer::start(std::function<void()> task, unsigned interval, eTimerType etype) {
+    startMs(task, interval * 1000, etype);
+}
+
+void Timer::startMs(std::function<void()> task, unsigned interval, eTimerType etype) {
     stop();
     task_ = task;
     interval_ = interval;
@@ -16,7 +16,14 @@ public:
     Timer(TimerManager *tmMgr);
     ~Timer();
 public:
+    /**
+     * Arms the timer, interval is in seconds.
+     */
     void start(std::function<void()> task, unsigned interval, eTimerType ntype = TIMER_ONCE);
+    /**
+     * Arms the timer, interval is in milliseconds.
+     */
+    void startMs(std::function<void()> task, unsigned interval, eTimerType ntype = TIMER_ONCE);
     void stop();
 //Override
 public:
@@ -27,7 +34,7 @@ protected:
     TimerManager *tmMgr_;
     std::function<void()> task_;
     eTimerType type_;
-    unsigned interval_;
+    unsigned interval_;     // milliseconds
     struct event tm_;
     bool owned_;
 };
@@ -0,0 +1,245 @@
+#ifndef __CF_TIMER_HEAP_H
+#define __CF_TIMER_HEAP_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+/**
+ * State of a scheduled task shared by its handles and its heap entry.
+ */
+struct TimerState {
+    enum STATUS { PENDING, CANCELLED, RELEASED };
+
+    explicit TimerState(const std::shared_ptr<std::atomic<size_t> >& cancelled)
+        : status_(PENDING)
+        , cancelled_(cancelled) {}
+
+    std::atomic<int> status_;
+    std::shared_ptr<std::atomic<size_t> > cancelled_;  // cancelled entries still in the heap
+};
+
+/**
+ * Cancellation handle of a task scheduled on a pool.
+ *
+ * Copies share the same task. Cancelling is idempotent and may be done from
+ * any thread; a periodic task stops at its next period, a task that has
+ * already been released to the ready queue is not recalled, and does not
+ * count as cancelled.
+ */
+class TimerHandle {
+public:
+    TimerHandle() {}
+    explicit TimerHandle(const std::shared_ptr<TimerState>& state)
+        : state_(state) {}
+
+public:
+    void cancel() {
+        int status = TimerState::PENDING;
+        if (state_ && state_->status_.compare_exchange_strong(status, TimerState::CANCELLED)) {
+            state_->cancelled_->fetch_add(1);
+        }
+    }
+
+    bool cancelled() const {
+        return state_ && state_->status_.load() == TimerState::CANCELLED;
+    }
+
+    bool valid() const {
+        return (bool)state_;
+    }
+
+private:
+    std::shared_ptr<TimerState> state_;
+};
+
+/**
+ * Min-heap of scheduled tasks keyed by steady-clock deadline.
+ *
+ * Not synchronized: the owning pool keeps it under its queue lock and its
+ * idle workers sleep until next(), then move due tasks straight into the
+ * ready queue with popDue(). Cancelled entries are dropped when they reach
+ * the top, so next() is always a live deadline, and all at once when they make
+ * up more than half of the heap, so cancelled timeouts do not pile up.
+ */
+template <class T>
+class TimerHeap {
+public:
+    typedef std::chrono::steady_clock Clock;
+    typedef Clock::time_point TimePoint;
+    typedef Clock::duration Duration;
+
+public:
+    TimerHeap()
+        : seq_(0)
+        , cancelled_(std::make_shared<std::atomic<size_t> >(0)) {}
+
+public:
+    /**
+     * Schedules a task at the given time, repeating every period if it is not zero.
+     */
+    TimerHandle push(TimePoint when, const T& task, Duration period = Duration::zero()) {
+        Entry entry;
+        entry.when_ = when;
+        entry.seq_ = seq_++;
+        entry.period_ = period;
+        entry.task_ = task;
+        entry.state_ = std::make_shared<TimerState>(cancelled_);
+
+        compact();
+        heap_.push_back(entry);
+        std::push_heap(heap_.begin(), heap_.end(), Later());
+        return TimerHandle(entry.state_);
+    }
+
+    /**
+     * Hands every task due at now to sink, reschedules periodic ones.
+     * \returns the number of tasks handed out
+     */
+    template <class Sink>
+    size_t popDue(TimePoint now, Sink sink) {
+        size_t count = 0;
+        compact();
+        while (dropCancelledTop() && heap_.front().when_ <= now) {
+            std::pop_heap(heap_.begin(), heap_.end(), Later());
+            Entry& entry = heap_.back();
+            bool periodic = entry.period_ > Duration::zero();
+            if (!periodic && !release(entry)) {
+                heap_.pop_back();
+                continue;
+            }
+
+            sink(entry.task_);
+            ++count;
+
+            if (periodic) {
+                // fixed rate, but a late timer does not replay the missed periods
+                entry.when_ += entry.period_;
+                if (entry.when_ <= now) {
+                    entry.when_ = now + entry.period_;
+                }
+                entry.seq_ = seq_++;
+                std::push_heap(heap_.begin(), heap_.end(), Later());
+            } else {
+                heap_.pop_back();
+            }
+        }
+        return count;
+    }
+
+    /**
+     * Gets the earliest deadline of a task not cancelled, the heap must not be
+     * empty()
+     */
+    TimePoint next() {
+        dropCancelledTop();
+        return heap_.front().when_;
+    }
+
+    /**
+     * \returns whether no task is left that was not cancelled
+     */
+    bool empty() {
+        return !dropCancelledTop();
+    }
+
+    /**
+     * Gets the number of entries, cancelled ones not dropped yet included
+     */
+    size_t size() const {
+        return heap_.size();
+    }
+
+    void clear() {
+        for (size_t i = 0; i < heap_.size(); ++i) {
+            forget(heap_[i]);
+        }
+        heap_.clear();
+    }
+
+private:
+    struct Entry {
+        TimePoint when_;
+        uint64_t seq_;          // keeps FIFO order among equal deadlines
+        Duration period_;
+        T task_;
+        std::shared_ptr<TimerState> state_;
+    };
+
+    struct Later {
+        bool operator()(const Entry& lhs, const Entry& rhs) const {
+            return lhs.when_ > rhs.when_ || (lhs.when_ == rhs.when_ && lhs.seq_ > rhs.seq_);
+        }
+    };
+
+    static bool isCancelled(const Entry& entry) {
+        return entry.state_->status_.load() == TimerState::CANCELLED;
+    }
+
+    /**
+     * Marks a one-shot entry as released, so that cancelling it no longer counts.
+     * \returns false if it was cancelled first
+     */
+    static bool release(Entry& entry) {
+        int status = TimerState::PENDING;
+        if (entry.state_->status_.compare_exchange_strong(status, TimerState::RELEASED)) {
+            return true;
+        }
+        entry.state_->cancelled_->fetch_sub(1);
+        return false;
+    }
+
+    /**
+     * An entry leaves the heap without running, a late cancel must not count.
+     */
+    static void forget(Entry& entry) {
+        int status = TimerState::PENDING;
+        if (!entry.state_->status_.compare_exchange_strong(status, TimerState::RELEASED)) {
+            entry.state_->cancelled_->fetch_sub(1);
+        }
+    }
+
+    /**
+     * Pops the cancelled entries off the top.
+     * \returns whether an entry is left
+     */
+    bool dropCancelledTop() {
+        while (!heap_.empty() && isCancelled(heap_.front())) {
+            std::pop_heap(heap_.begin(), heap_.end(), Later());
+            forget(heap_.back());
+            heap_.pop_back();
+        }
+        return !heap_.empty();
+    }
+
+    /**
+     * Removes all the cancelled entries once they are more than half of the heap.
+     */
+    void compact() {
+        if (cancelled_->load(std::memory_order_relaxed) * 2 <= heap_.size()) {
+            return;
+        }
+        size_t kept = 0;
+        for (size_t i = 0; i < heap_.size(); ++i) {
+            if (isCancelled(heap_[i])) {
+                forget(heap_[i]);
+            } else {
+                if (kept != i) {
+                    heap_[kept] = std::move(heap_[i]);
+                }
+                ++kept;
+            }
+        }
+        heap_.erase(heap_.begin() + kept, heap_.end());
+        std::make_heap(heap_.begin(), heap_.end(), Later());
+    }
+
+    std::vector<Entry> heap_;
+    uint64_t seq_;
+    std::shared_ptr<std::atomic<size_t> > cancelled_;  // shared with the entries, see TimerState
+};
+
+#endif
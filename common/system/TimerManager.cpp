@@ -1,5 +1,6 @@
 #include "TimerManager.h"
 #include <algorithm>
+#include "../utils/utime.h"
 
 #define evtimer2_set(ev, cb, arg) event_set(ev, -1, EV_PERSIST, cb, arg)
 
@@ -62,8 +63,7 @@ void TimerManager::addTimer(Timer *timer) {
 
         struct timeval tv;
         evutil_timerclear(&tv);
-        tv.tv_sec = (int)(timer->interval_);
-        tv.tv_usec = (timer->interval_ - tv.tv_sec) * 1000000;
+        Util::toTimeval(tv, timer->interval_);
 
         evtimer_add(&(timer->tm_), &tv);
     }
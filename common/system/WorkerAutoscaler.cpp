@@ -0,0 +1,251 @@
+#include "WorkerAutoscaler.h"
+#include <stdio.h>
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+#include "../logcpp/log.h"
+#include "../utils/utime.h"
+#include "ThreadManager.h"
+
+WorkerAutoscaler::WorkerAutoscaler(ThreadManager* manager, const Options& options)
+    : manager_(manager)
+    , options_(options)
+    , running_(false)
+    , lastTime_(0)
+    , lastWaitTime_(0)
+    , lastDequeued_(0)
+    , lastCpuBusy_(0)
+    , lastCpuTotal_(0)
+    , lowIntervals_(0)
+    , hold_(0)
+    , lastStep_(0)
+    , stepThroughput_(0)
+    , stepWait_(0) {
+    if (options_.minWorkers < 1) {
+        options_.minWorkers = 1;
+    }
+    if (options_.maxWorkers < options_.minWorkers) {
+        options_.maxWorkers = options_.minWorkers;
+    }
+    if (options_.interval < 1) {
+        options_.interval = 1;
+    }
+}
+
+WorkerAutoscaler::~WorkerAutoscaler() {
+    stop();
+}
+
+void WorkerAutoscaler::start() {
+    Synchronized s(monitor_);
+    if (running_) {
+        return;
+    }
+
+    size_t workers = manager_->workerCount();
+    if (workers < options_.minWorkers) {
+        manager_->addWorker(options_.minWorkers - workers);
+    } else if (workers > options_.maxWorkers) {
+        manager_->removeWorker(workers - options_.maxWorkers);
+    }
+
+    // the first interval starts now
+    lastTime_ = Util::monotonicTimeUsec();
+    lastWaitTime_ = manager_->queueWaitTime();
+    lastDequeued_ = manager_->dequeuedTaskCount();
+    readCpuStat(lastCpuBusy_, lastCpuTotal_);
+
+    running_ = true;
+    thread_ = std::thread(&WorkerAutoscaler::run, this);
+}
+
+void WorkerAutoscaler::stop() {
+    {
+        Synchronized s(monitor_);
+        if (!running_) {
+            return;
+        }
+        running_ = false;
+        monitor_.notifyAll();
+    }
+    thread_.join();
+}
+
+WorkerAutoscaler::Metrics WorkerAutoscaler::metrics() const {
+    Synchronized s(monitor_);
+    return metrics_;
+}
+
+void WorkerAutoscaler::run() {
+    Synchronized s(monitor_);
+    while (running_) {
+        monitor_.waitForTimeRelative(options_.interval);
+        if (!running_) {
+            break;
+        }
+        // manager calls may block on the workers, metrics() must not wait for them
+        monitor_.mutex().unlock();
+        sample();
+        monitor_.mutex().lock();
+    }
+}
+
+WorkerAutoscaler::Decision WorkerAutoscaler::sample() {
+    int64_t now = Util::monotonicTimeUsec();
+    uint64_t waitTime = manager_->queueWaitTime();
+    uint64_t dequeued = manager_->dequeuedTaskCount();
+    size_t workers = manager_->workerCount();
+    size_t idle = manager_->idleWorkerCount();
+    size_t pending = manager_->pendingTaskCount();
+
+    int64_t elapsed = now > lastTime_ ? now - lastTime_ : 1;
+    uint64_t count = dequeued - lastDequeued_;
+    int64_t wait;
+    if (count > 0) {
+        wait = (int64_t)((waitTime - lastWaitTime_) / count);
+    } else {
+        // nothing was dequeued: either there is no work or every worker is stuck
+        wait = pending > 0 && idle == 0 ? elapsed : 0;
+    }
+    double throughput = count * 1000000.0 / elapsed;
+
+    double cpuBusy = -1;
+    uint64_t busy, total;
+    if (readCpuStat(busy, total)) {
+        if (total > lastCpuTotal_) {
+            cpuBusy = (double)(busy - lastCpuBusy_) / (total - lastCpuTotal_);
+        }
+        lastCpuBusy_ = busy;
+        lastCpuTotal_ = total;
+    }
+    double cpuPressure = readCpuPressure();
+
+    lastTime_ = now;
+    lastWaitTime_ = waitTime;
+    lastDequeued_ = dequeued;
+
+    Decision decision = HOLD;
+    int64_t delta = 0;
+    int64_t high = (int64_t)(options_.targetWait * (1 + options_.tolerance));
+    int64_t low = (int64_t)(options_.targetWait * (1 - options_.tolerance));
+
+    if (lastStep_ > 0 && wait > high
+            && throughput < stepThroughput_ * (1 + options_.minGain) && wait >= stepWait_) {
+        // the last workers added did not help, the bottleneck is elsewhere
+        decision = REVERT;
+        delta = -lastStep_;
+        hold_ = options_.holdAfterRevert;
+    } else if (wait > high) {
+        lowIntervals_ = 0;
+        bool saturated = (cpuPressure >= 0 && cpuPressure > options_.cpuPressureMax)
+                         || (cpuBusy >= 0 && cpuBusy > options_.cpuBusyMax);
+        if (hold_ == 0 && !saturated && workers < options_.maxWorkers && idle == 0) {
+            // proportional step, at least one worker and at most doubling
+            double over = (double)(wait - options_.targetWait) / options_.targetWait;
+            delta = (int64_t)(workers * over * 0.5);
+            if (delta < 1) {
+                delta = 1;
+            } else if (delta > (int64_t)workers) {
+                delta = workers;
+            }
+            if (workers + delta > options_.maxWorkers) {
+                delta = options_.maxWorkers - workers;
+            }
+            decision = GROW;
+        }
+    } else if (wait < low && idle > 0 && workers > options_.minWorkers) {
+        if (++lowIntervals_ >= options_.shrinkAfter) {
+            // half of the idle workers, the next ones after as many quiet intervals
+            lowIntervals_ = 0;
+            delta = -(int64_t)std::max<size_t>(idle / 2, 1);
+            if (workers + delta < options_.minWorkers) {
+                delta = -(int64_t)(workers - options_.minWorkers);
+            }
+            decision = SHRINK;
+        }
+    } else {
+        lowIntervals_ = 0;
+    }
+
+    if (hold_ > 0 && decision != REVERT) {
+        --hold_;
+    }
+    if (decision == GROW) {
+        lastStep_ = delta;
+        stepThroughput_ = throughput;
+        stepWait_ = wait;
+    } else {
+        lastStep_ = 0;
+    }
+
+    if (delta != 0) {
+        LOG_C(LOG_INFO, "autoscaler: %d workers %lu, wait %ldus target %ldus, %.0f tasks/s, cpu busy %.2f pressure %.1f",
+              (int)decision, workers, wait, options_.targetWait, throughput, cpuBusy, cpuPressure);
+        resize(delta);
+    }
+
+    Synchronized s(monitor_);
+    metrics_.samples++;
+    metrics_.lastDecision = decision;
+    if (delta > 0) {
+        metrics_.grown += delta;
+    } else if (delta < 0) {
+        metrics_.shrunk += -delta;
+    }
+    if (decision == REVERT) {
+        metrics_.reverts++;
+    }
+    metrics_.workers = manager_->workerCount();
+    metrics_.idleWorkers = idle;
+    metrics_.pendingTasks = pending;
+    metrics_.queueWait = wait;
+    metrics_.throughput = throughput;
+    metrics_.cpuPressure = cpuPressure;
+    metrics_.cpuBusy = cpuBusy;
+    return decision;
+}
+
+void WorkerAutoscaler::resize(int64_t delta) {
+    if (delta > 0) {
+        manager_->addWorker(delta);
+    } else if (delta < 0) {
+        manager_->removeWorker(-delta);
+    }
+}
+
+bool WorkerAutoscaler::readCpuStat(uint64_t& busy, uint64_t& total) {
+    FILE* file = fopen("/proc/stat", "r");
+    if (!file) {
+        return false;
+    }
+    unsigned long long user = 0, nice = 0, system = 0, idle = 0, iowait = 0, irq = 0, softirq = 0, steal = 0;
+    int fields = fscanf(file, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+                        &user, &nice, &system, &idle, &iowait, &irq, &softirq, &steal);
+    fclose(file);
+    if (fields < 4) {
+        return false;
+    }
+    total = user + nice + system + idle + iowait + irq + softirq + steal;
+    busy = total - idle - iowait;
+    return true;
+}
+
+double WorkerAutoscaler::readCpuPressure() {
+    FILE* file = fopen("/proc/pressure/cpu", "r");
+    if (!file) {
+        return -1;
+    }
+    double avg10 = -1;
+    char line[256];
+    while (fgets(line, sizeof(line), file)) {
+        if (strncmp(line, "some ", 5) == 0) {
+            const char* value = strstr(line, "avg10=");
+            if (value) {
+                avg10 = atof(value + 6);
+            }
+            break;
+        }
+    }
+    fclose(file);
+    return avg10;
+}
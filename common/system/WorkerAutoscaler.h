@@ -0,0 +1,140 @@
+#ifndef __CF_WORKER_AUTOSCALER_H
+#define __CF_WORKER_AUTOSCALER_H
+
+#include <stdint.h>
+#include <thread>
+#include "Monitor.h"
+
+class ThreadManager;
+
+/**
+ * Controller thread resizing the worker set of a ThreadManager between a
+ * minimum and a maximum, aiming at a target queue wait with as few workers as
+ * possible.
+ *
+ * Every interval it samples the queue length, the average time the tasks
+ * dequeued meanwhile spent queued, the idle workers, the CPU pressure stall
+ * (/proc/pressure/cpu, where available) and the CPU utilization (/proc/stat).
+ *
+ * - Above the target band it adds workers in proportion to how far the wait is
+ *   over the target, unless the CPUs are already saturated: more threads would
+ *   only make them wait for a core instead of for a worker.
+ * - Hill climbing: when workers were just added and neither the throughput nor
+ *   the wait improved, they are taken back and growing pauses for a while.
+ * - Below the band it removes half of the idle workers, and only after the load
+ *   stayed low for several intervals, so it does not flap.
+ *
+ * Its decisions and the last sample are exposed through metrics().
+ */
+class WorkerAutoscaler {
+public:
+    struct Options {
+        size_t minWorkers;
+        size_t maxWorkers;
+        int64_t targetWait;         // microseconds of average queue wait
+        int64_t interval;           // milliseconds between samples
+        double tolerance;           // the band around targetWait where nothing changes, as a fraction of it
+        uint32_t shrinkAfter;       // intervals below the band before a worker is removed
+        uint32_t holdAfterRevert;   // intervals without growing after a reverted step
+        double minGain;             // throughput gain a step must bring, as a fraction
+        double cpuPressureMax;      // "some avg10" percentage over which workers are not added
+        double cpuBusyMax;          // utilization over which workers are not added, 0 to 1
+
+        Options()
+            : minWorkers(1)
+            , maxWorkers(64)
+            , targetWait(5000)
+            , interval(500)
+            , tolerance(0.2)
+            , shrinkAfter(4)
+            , holdAfterRevert(8)
+            , minGain(0.05)
+            , cpuPressureMax(40.0)
+            , cpuBusyMax(0.95) {}
+    };
+
+    enum Decision { HOLD, GROW, SHRINK, REVERT };
+
+    struct Metrics {
+        uint64_t samples;
+        uint64_t grown;             // workers added
+        uint64_t shrunk;            // workers removed, reverts included
+        uint64_t reverts;
+        Decision lastDecision;
+        size_t workers;
+        size_t idleWorkers;
+        size_t pendingTasks;
+        int64_t queueWait;          // microseconds, average over the last interval
+        double throughput;          // tasks dequeued per second over the last interval
+        double cpuPressure;         // "some avg10" percentage, -1 if not available
+        double cpuBusy;             // 0 to 1, -1 if not available
+
+        Metrics()
+            : samples(0)
+            , grown(0)
+            , shrunk(0)
+            , reverts(0)
+            , lastDecision(HOLD)
+            , workers(0)
+            , idleWorkers(0)
+            , pendingTasks(0)
+            , queueWait(0)
+            , throughput(0)
+            , cpuPressure(-1)
+            , cpuBusy(-1) {}
+    };
+
+public:
+    /**
+     * The manager must be started and outlive the autoscaler.
+     */
+    WorkerAutoscaler(ThreadManager* manager, const Options& options = Options());
+    ~WorkerAutoscaler();
+
+public:
+    /**
+     * Starts the controller thread, after bringing the worker count within bounds.
+     */
+    void start();
+
+    /**
+     * Stops and joins the controller thread, the workers stay as they are.
+     */
+    void stop();
+
+    /**
+     * Takes one sample and acts on it, what the controller thread does every interval.
+     * For driving the autoscaler without its thread, not to be called once started.
+     * \returns the decision
+     */
+    Decision sample();
+
+    Metrics metrics() const;
+
+private:
+    void run();
+    void resize(int64_t delta);
+    static bool readCpuStat(uint64_t& busy, uint64_t& total);
+    static double readCpuPressure();
+
+private:
+    ThreadManager* manager_;
+    Options options_;
+    Monitor monitor_;           // guards the rest
+    bool running_;
+    std::thread thread_;
+    Metrics metrics_;
+
+    int64_t lastTime_;          // microseconds, monotonic
+    uint64_t lastWaitTime_;
+    uint64_t lastDequeued_;
+    uint64_t lastCpuBusy_;
+    uint64_t lastCpuTotal_;
+    uint32_t lowIntervals_;     // consecutive intervals below the band
+    uint32_t hold_;             // intervals left without growing
+    int64_t lastStep_;          // workers added by the previous sample, 0 if it did not grow
+    double stepThroughput_;     // throughput and wait before that step
+    int64_t stepWait_;
+};
+
+#endif
@@ -1,5 +1,11 @@
 #include "utime.h"
 #include <sys/time.h>
+#include <algorithm>
+#include <atomic>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
 
 int64_t Util::currentTimeTicks(int64_t ticksPerSec) {
     int64_t result;
@@ -10,3 +16,180 @@ int64_t Util::currentTimeTicks(int64_t ticksPerSec) {
     return result;
 }
 
+
+int64_t Util::monotonicTimeTicks(int64_t ticksPerSec) {
+    int64_t result;
+    struct timespec now;
+    int ret = clock_gettime(CLOCK_MONOTONIC, &now);
+    assert(ret == 0);
+    toTicks(result, now, ticksPerSec);
+    return result;
+}
+
+int64_t Util::coarseTimeTicks(int64_t ticksPerSec) {
+    int64_t result;
+    struct timespec now;
+    int ret = clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    assert(ret == 0);
+    toTicks(result, now, ticksPerSec);
+    return result;
+}
+
+#if defined(__x86_64__)
+namespace {
+
+/**
+ * Maps TSC readings to CLOCK_MONOTONIC nanoseconds: an anchor (a TSC reading and
+ * the time it stands for) plus the ticks since then times a 32.32 fixed-point scale.
+ *
+ * The rate is measured over 2ms when the program starts, then every second of use
+ * the rate is measured again over the whole time since then. The new anchor is the
+ * time the clock shows, not CLOCK_MONOTONIC, so the clock never jumps; the error
+ * is slewed away instead, the scale being set so that the clock meets
+ * CLOCK_MONOTONIC again a second later. Readers get a consistent anchor through a
+ * sequence lock.
+ */
+class TscClock {
+public:
+    TscClock()
+        : usable_(false)
+        , tscOrigin_(0)
+        , nsOrigin_(0)
+        , period_(0)
+        , rate_(0)
+        , seq_(0)
+        , tscBase_(0)
+        , nsBase_(0)
+        , scale_(0)
+        , anchoring_(false) {
+        if (!invariant()) {
+            return;
+        }
+        nsOrigin_ = monotonicNsec();
+        tscOrigin_ = __rdtsc();
+        int64_t ns;
+        do {
+            ns = monotonicNsec();
+        } while (ns - nsOrigin_ < 2000000);
+        uint64_t tsc = __rdtsc();
+        if (tsc <= tscOrigin_) {
+            return;
+        }
+        uint64_t scale = (uint64_t)(((unsigned __int128)(ns - nsOrigin_) << 32) / (tsc - tscOrigin_));
+        if (scale == 0) {
+            return;
+        }
+        period_ = (uint64_t)(((unsigned __int128)1000000000LL << 32) / scale);
+        rate_ = scale;
+        tscBase_.store(tsc, std::memory_order_relaxed);
+        nsBase_.store(ns, std::memory_order_relaxed);
+        scale_.store(scale, std::memory_order_relaxed);
+        usable_ = true;
+    }
+
+public:
+    bool usable() const {
+        return usable_;
+    }
+
+    int64_t now() {
+        for (;;) {
+            uint32_t seq = seq_.load(std::memory_order_acquire);
+            uint64_t base = tscBase_.load(std::memory_order_relaxed);
+            int64_t ns = nsBase_.load(std::memory_order_relaxed);
+            uint64_t scale = scale_.load(std::memory_order_relaxed);
+            uint64_t tsc = __rdtsc();
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if ((seq & 1) != 0 || seq_.load(std::memory_order_relaxed) != seq) {
+                continue;
+            }
+            uint64_t ticks = tsc > base ? tsc - base : 0;
+            if (ticks > period_ && anchor()) {
+                continue;
+            }
+            ns += (int64_t)(((unsigned __int128)ticks * scale) >> 32);
+            // a reading racing an anchor may land a little behind the last one
+            static thread_local int64_t last = 0;
+            if (ns < last) {
+                return last;
+            }
+            last = ns;
+            return ns;
+        }
+    }
+
+private:
+    static bool invariant() {
+        unsigned int eax, ebx, ecx, edx;
+        if (__get_cpuid_max(0x80000000, NULL) < 0x80000007) {
+            return false;
+        }
+        __cpuid(0x80000007, eax, ebx, ecx, edx);
+        return (edx & (1 << 8)) != 0;
+    }
+
+    static int64_t monotonicNsec() {
+        return Util::monotonicTimeTicks(1000000000LL);
+    }
+
+    /**
+     * \returns false if another thread is anchoring the clock
+     */
+    bool anchor() {
+        bool expected = false;
+        if (!anchoring_.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+            return false;
+        }
+        uint32_t seq = seq_.load(std::memory_order_relaxed);
+        seq_.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        int64_t ns = monotonicNsec();
+        uint64_t tsc = __rdtsc();
+        uint64_t base = tscBase_.load(std::memory_order_relaxed);
+        int64_t shown = nsBase_.load(std::memory_order_relaxed) +
+                        (int64_t)(((unsigned __int128)(tsc - base) * scale_.load(std::memory_order_relaxed)) >> 32);
+        uint64_t rate = (uint64_t)(((unsigned __int128)(ns - nsOrigin_) << 32) / (tsc - tscOrigin_));
+        if (rate != 0) {
+            rate_ = rate;
+        }
+        // meet CLOCK_MONOTONIC a period from now, at no less than half or more than
+        // twice the measured rate
+        int64_t target = ns + (int64_t)(((unsigned __int128)period_ * rate_) >> 32);
+        uint64_t scale = target > shown ? (uint64_t)(((unsigned __int128)(target - shown) << 32) / period_) : 0;
+        scale = std::max(rate_ / 2, std::min(scale, rate_ * 2));
+
+        tscBase_.store(tsc, std::memory_order_relaxed);
+        nsBase_.store(shown, std::memory_order_relaxed);
+        scale_.store(scale, std::memory_order_relaxed);
+        seq_.store(seq + 2, std::memory_order_release);
+        anchoring_.store(false, std::memory_order_release);
+        return true;
+    }
+
+    bool usable_;
+    uint64_t tscOrigin_;        // first anchor, the rate is measured from there
+    int64_t nsOrigin_;
+    uint64_t period_;           // ticks in a second, between anchors
+    uint64_t rate_;             // measured scale, anchoring thread only
+    std::atomic<uint32_t> seq_;
+    std::atomic<uint64_t> tscBase_;
+    std::atomic<int64_t> nsBase_;
+    std::atomic<uint64_t> scale_;
+    std::atomic<bool> anchoring_;
+};
+
+// calibrated while the program starts rather than in the first caller, often a hot
+// path; callers from other static initializers before that get CLOCK_MONOTONIC
+TscClock tscClock;
+
+}
+
+int64_t Util::tscTimeNsec() {
+    return tscClock.usable() ? tscClock.now() : monotonicTimeTicks(NS_PER_S);
+}
+#else
+int64_t Util::tscTimeNsec() {
+    return monotonicTimeTicks(NS_PER_S);
+}
+#endif
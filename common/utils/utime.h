@@ -114,6 +114,53 @@ public:
     static int64_t currentTimeUsec() {
         return currentTimeTicks(US_PER_S);
     }
+
+    /**
+     * Get monotonic time as a number of arbitrary-size ticks from an unspecified
+     * starting point. Not affected by changes of the system wall clock.
+     */
+    static int64_t monotonicTimeTicks(int64_t ticksPerSec);
+
+    /**
+     * Get monotonic time as milliseconds
+     */
+    static int64_t monotonicTime() {
+        return monotonicTimeTicks(MS_PER_S);
+    }
+
+    /**
+     * Get monotonic time as micros
+     */
+    static int64_t monotonicTimeUsec() {
+        return monotonicTimeTicks(US_PER_S);
+    }
+
+    /**
+     * Clocks for hot paths, from the cheapest to the most precise. All of them are
+     * monotonic and share their starting point with monotonicTime(), so values of
+     * different clocks in the same unit can be compared, up to their resolution.
+     */
+
+    /**
+     * Get monotonic time as a number of ticks from CLOCK_MONOTONIC_COARSE, the time of
+     * the last kernel tick (1-4ms behind depending on CONFIG_HZ); cheaper than the
+     * precise clocks as it reads no hardware counter.
+     */
+    static int64_t coarseTimeTicks(int64_t ticksPerSec);
+
+    /**
+     * Get coarse monotonic time as milliseconds
+     */
+    static int64_t coarseTime() {
+        return coarseTimeTicks(MS_PER_S);
+    }
+
+    /**
+     * Get monotonic time as nanoseconds from the CPU timestamp counter, calibrated
+     * against CLOCK_MONOTONIC at startup. Never goes backwards within a thread. Without
+     * an invariant TSC (or off x86-64) it is CLOCK_MONOTONIC.
+     */
+    static int64_t tscTimeNsec();
 };
 
 #endif
@@ -0,0 +1,274 @@
+/**
+ * Stress checks of the lock-free and sharded queues in common/system.
+ *
+ * Every queue gets PRODUCERS threads pushing ITEMS tagged values each and
+ * CONSUMERS threads popping them. The checks are that nothing is lost or
+ * duplicated (count and sum), and, for the FIFO queues, that each consumer sees
+ * the items of any one producer in the order they were pushed.
+ *
+ * Built and run by `make check`, not part of libtest.a.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <thread>
+#include <vector>
+#include "system/ConcurrentPriorityQueue.h"
+#include "system/IndexedHeap.h"
+#include "system/MPMCQueue.h"
+#include "system/MPMCRing.h"
+#include "system/MulticastRing.h"
+#include "system/SegmentedQueue.h"
+
+static const int PRODUCERS = 4;
+static const int CONSUMERS = 4;
+static const uint64_t ITEMS = 100000;       // per producer
+static const uint64_t TOTAL = PRODUCERS * ITEMS;
+
+static int failures = 0;
+
+static uint64_t tag(uint64_t producer, uint64_t seq) {
+    return (producer << 32) | seq;
+}
+
+static uint64_t expectedSum() {
+    uint64_t sum = 0;
+    for (uint64_t p = 0; p < PRODUCERS; ++p) {
+        for (uint64_t i = 0; i < ITEMS; ++i) {
+            sum += tag(p, i);
+        }
+    }
+    return sum;
+}
+
+static void report(const char* name, bool ok, const char* what) {
+    printf("%-36s %s%s%s\n", name, ok ? "ok" : "FAILED", ok ? "" : ": ", ok ? "" : what);
+    if (!ok) {
+        ++failures;
+    }
+}
+
+/**
+ * Runs the producers and consumers. pop(value) returns false when it found
+ * nothing this time; consumers keep going until TOTAL items came out.
+ */
+static void stress(const char* name, bool fifo,
+                   const std::function<void(uint64_t)>& push,
+                   const std::function<bool(uint64_t&)>& pop) {
+    std::atomic<uint64_t> popped(0);
+    std::atomic<uint64_t> sum(0);
+    std::atomic<bool> ordered(true);
+
+    std::vector<std::thread> threads;
+    for (int c = 0; c < CONSUMERS; ++c) {
+        threads.push_back(std::thread([&]() {
+            std::vector<int64_t> last(PRODUCERS, -1);
+            uint64_t local = 0;
+            while (popped.load(std::memory_order_relaxed) < TOTAL) {
+                uint64_t value;
+                if (!pop(value)) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                popped.fetch_add(1, std::memory_order_relaxed);
+                local += value;
+                uint64_t producer = value >> 32;
+                int64_t seq = (int64_t)(value & 0xffffffffULL);
+                if (producer >= PRODUCERS || (fifo && seq <= last[producer])) {
+                    ordered = false;
+                } else {
+                    last[producer] = seq;
+                }
+            }
+            sum.fetch_add(local);
+        }));
+    }
+    for (int p = 0; p < PRODUCERS; ++p) {
+        threads.push_back(std::thread([&, p]() {
+            for (uint64_t i = 0; i < ITEMS; ++i) {
+                push(tag(p, i));
+            }
+        }));
+    }
+    for (size_t i = 0; i < threads.size(); ++i) {
+        threads[i].join();
+    }
+
+    if (popped != TOTAL || sum != expectedSum()) {
+        report(name, false, "items lost or duplicated");
+    } else {
+        report(name, ordered, "per-producer order broken");
+    }
+}
+
+static void testMPMCRing() {
+    MPMCRing<uint64_t> ring(1024);
+    stress("MPMCRing", true,
+           [&](uint64_t value) {
+               while (!ring.tryPush(value)) {
+                   std::this_thread::yield();
+               }
+           },
+           [&](uint64_t& value) { return ring.tryPop(value); });
+}
+
+static void testMPMCQueue() {
+    // small, so that producers block on a full queue too
+    MPMCQueue<uint64_t> queue(256);
+    stress("MPMCQueue", true,
+           [&](uint64_t value) { queue.push(value); },
+           [&](uint64_t& value) {
+               bool bstat;
+               value = queue.pop_front(bstat, 10);
+               return bstat;
+           });
+}
+
+static void testSegmentedQueue() {
+    // small segments, so that they are retired and reused all the time
+    SegmentedQueue<uint64_t, 64> queue(4);
+    stress("SegmentedQueue", true,
+           [&](uint64_t value) { queue.push(value); },
+           [&](uint64_t& value) {
+               bool bstat;
+               value = queue.pop_front(bstat, 10);
+               return bstat;
+           });
+    report("SegmentedQueue drained", queue.empty(), "items left over");
+}
+
+static void testConcurrentPriorityQueue() {
+    ConcurrentPriorityQueue<uint64_t> relaxed(ConcurrentPriorityQueue<uint64_t>::RELAXED, 8);
+    stress("ConcurrentPriorityQueue RELAXED", false,
+           [&](uint64_t value) { relaxed.push(value); },
+           [&](uint64_t& value) { return relaxed.tryPop(value); });
+
+    ConcurrentPriorityQueue<uint64_t> strict(ConcurrentPriorityQueue<uint64_t>::STRICT, 4);
+    stress("ConcurrentPriorityQueue STRICT", false,
+           [&](uint64_t value) { strict.push(value); },
+           [&](uint64_t& value) { return strict.tryPop(value); });
+
+    // without concurrent pushes STRICT pops in order
+    for (uint64_t i = 0; i < 10000; ++i) {
+        strict.push((i * 7919) % 10007);
+    }
+    bool sorted = true;
+    uint64_t prev = UINT64_MAX;
+    uint64_t value;
+    while (strict.tryPop(value)) {
+        sorted = sorted && value <= prev;
+        prev = value;
+    }
+    report("ConcurrentPriorityQueue STRICT order", sorted, "popped out of order");
+}
+
+static void testMulticastRing() {
+    typedef MulticastRing<uint64_t> Ring;
+    Ring ring(1024, Ring::MULTI);
+    Ring::Reader& first = ring.addReader();
+    Ring::Reader& second = ring.addReader();
+    Ring::Reader& last = ring.addReader({ &first, &second });
+
+    // every reader sees every event, in sequence order
+    std::atomic<bool> ok(true);
+    std::vector<std::thread> threads;
+    Ring::Reader* readers[] = { &first, &second, &last };
+    for (int r = 0; r < 3; ++r) {
+        Ring::Reader* reader = readers[r];
+        bool dependent = r == 2;
+        threads.push_back(std::thread([&, reader, dependent]() {
+            std::vector<int64_t> lastSeq(PRODUCERS, -1);
+            uint64_t count = 0;
+            uint64_t sum = 0;
+            int64_t expected = 0;
+            while (count < TOTAL) {
+                count += reader->read([&](uint64_t& value, int64_t seq, bool) {
+                    uint64_t producer = value >> 32;
+                    int64_t item = (int64_t)(value & 0xffffffffULL);
+                    if (seq != expected++ || producer >= PRODUCERS || item <= lastSeq[producer]) {
+                        ok = false;
+                    } else {
+                        lastSeq[producer] = item;
+                    }
+                    if (dependent && (seq > first.sequence() || seq > second.sequence())) {
+                        ok = false;
+                    }
+                    sum += value;
+                }, 10, 64);
+            }
+            if (sum != expectedSum()) {
+                ok = false;
+            }
+        }));
+    }
+    for (int p = 0; p < PRODUCERS; ++p) {
+        threads.push_back(std::thread([&, p]() {
+            for (uint64_t i = 0; i < ITEMS; i += 4) {
+                // claim in batches as well as one by one
+                size_t n = (size_t)std::min<uint64_t>(4, ITEMS - i);
+                int64_t end = ring.next(n);
+                int64_t begin = end - (int64_t)n + 1;
+                for (int64_t seq = begin; seq <= end; ++seq) {
+                    ring[seq] = tag(p, i + (uint64_t)(seq - begin));
+                }
+                ring.publish(begin, end);
+            }
+        }));
+    }
+    for (size_t i = 0; i < threads.size(); ++i) {
+        threads[i].join();
+    }
+    report("MulticastRing MULTI", ok, "a reader lost, reordered or overtook events");
+}
+
+static void testIndexedHeap() {
+    typedef IndexedHeap<uint64_t, uint64_t> Heap;
+    Heap heap;
+    std::map<uint64_t, Heap::Handle> handles;     // value -> handle
+    std::multimap<uint64_t, uint64_t> keys;       // key -> value, the expected heap
+    for (uint64_t i = 0; i < 10000; ++i) {
+        uint64_t key = (i * 7919) % 10007;
+        handles[i] = heap.push(key, i);
+        keys.insert(std::make_pair(key, i));
+    }
+    bool ok = true;
+    // move every third entry, drop every fifth
+    for (uint64_t i = 0; i < 10000; ++i) {
+        uint64_t key = heap.key(handles[i]);
+        std::multimap<uint64_t, uint64_t>::iterator it = keys.lower_bound(key);
+        while (it->second != i) {
+            ++it;
+        }
+        keys.erase(it);
+        if (i % 5 == 0) {
+            ok = ok && heap.erase(handles[i]) && !heap.contains(handles[i]);
+        } else {
+            if (i % 3 == 0) {
+                key = (key * 31) % 10007;
+                ok = ok && heap.update(handles[i], key);
+            }
+            keys.insert(std::make_pair(key, i));
+        }
+    }
+    ok = ok && heap.size() == keys.size();
+    while (ok && !heap.empty()) {
+        uint64_t key = heap.topKey();
+        ok = key == keys.rbegin()->first;
+        heap.pop();
+        keys.erase(--keys.end());
+    }
+    report("IndexedHeap update/erase", ok, "popped out of order");
+}
+
+int main() {
+    testMPMCRing();
+    testMPMCQueue();
+    testSegmentedQueue();
+    testConcurrentPriorityQueue();
+    testMulticastRing();
+    testIndexedHeap();
+    return failures == 0 ? 0 : 1;
+}